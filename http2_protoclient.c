@@ -17,15 +17,26 @@
 #ifdef CONFIG_WC_USE_IO_STREAMS
 #include "wcframe.h"
 #endif
+#include <unistd.h>
+#include <sys/select.h>
+#include <sys/time.h>
 #include "lwip/apps/sntp.h"
 #include "http2_protoclient.h"
 #include "sh2lib.h"
 #include "esp_log.h"
+#include "esp_tls.h"
+#include "esp_vfs_eventfd.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#ifdef CONFIG_WC_USE_IO_STREAMS
+#include "freertos/queue.h"
+#endif
 
 static const char * H2PC_TAG = "H2PC";
 
 /* current http2 connection */
 static struct sh2lib_handle hd;
+static int h2pc_wake_fd = -1;               // eventfd to interrupt the socket wait
 
 volatile int    h2pc_mode = 0;              // current client mode
 static   char * h2pc_sid = NULL;            // current session id
@@ -34,11 +45,47 @@ volatile int    h2pc_err_code = 0;          // last error code
 static   char * h2pc_last_stamp = NULL;     // last time stamp from server
 
 /* request data */
-volatile bool   bytes_need_to_free = false; // is current raw bytes need to free after request sent
-static char *   bytes_tosend = NULL;        // current raw bytes request content
-volatile int    bytes_tosend_len = 0;       // current raw bytes request content length
-volatile int    bytes_tosend_pos = 0;       // current raw bytes request content pos
-volatile bool   request_finished = false;   // is current request finished
+static SemaphoreHandle_t h2pc_sess_mux = NULL; // guards the http2 session and the requests list
+static h2pc_req_ctx * req_ctxs = NULL;      // requests in flight
+static h2pc_req_ctx * req_def = NULL;       // request of the low-level network methods
+static h2pc_req_ctx * req_done = NULL;      // async requests waiting for the completion
+static bool     sess_lost = false;          // goaway received. the session is closed after the exchange
+/* network task */
+volatile bool   net_running = false;
+volatile bool   net_stop = false;
+static SemaphoreHandle_t net_done = NULL;   // given by the network task on exit
+/* connection manager. the last connection data is kept to recover the connection */
+static char *   cm_server = NULL;
+static char *   cm_name = NULL;
+static char *   cm_pwrd = NULL;
+static char *   cm_dev = NULL;
+static cJSON *  cm_meta = NULL;
+#ifdef CONFIG_WC_USE_IO_STREAMS
+static char *   cm_inc_device = NULL;       // incoming stream to reopen
+static bool     cm_out_active = false;      // outgoing stream to reopen
+static char *   cm_out_subproto = NULL;
+static int __h2pc_is_open(const char * device_name);
+#endif
+static h2pc_cm_config cm_cfg;
+static h2pc_cb_cm_state cm_cb = NULL;
+static void *   cm_data = NULL;
+static SemaphoreHandle_t cm_kick = NULL;    // given on the lost connection and on stop
+static SemaphoreHandle_t cm_done = NULL;    // given by the manager task on exit
+volatile bool   cm_running = false;
+volatile bool   cm_stop = false;
+volatile bool   cm_lost = false;            // the connection is lost and not recovered yet
+static int64_t  cm_lost_at = 0;
+static h2pc_cm_stats cm_stats;
+static void __h2pc_conn_lost();
+static bool __h2pc_sess_lock();
+static void __h2pc_sess_unlock();
+static void __h2pc_req_ctx_free_tosend(h2pc_req_ctx * ctx);
+static bool __h2pc_req_ctx_append(h2pc_req_ctx * ctx, const char * data, size_t len);
+static bool __h2pc_sess_exchange(int32_t strm_id);
+static void __h2pc_req_complete(h2pc_req_ctx * ctx);
+#ifdef CONFIG_H2PC_DATA_NO_COPY
+static int  __h2pc_sess_recreate();
+#endif
 
 #ifdef CONFIG_WC_USE_IO_STREAMS
 /* outgoing frames */
@@ -46,26 +93,72 @@ static char *   bytes_frame = NULL;         // current raw bytes frame content
 volatile int    bytes_frame_len = 0;        // current raw bytes frame content length
 volatile int    bytes_frame_pos = 0;        // current raw bytes frame content pos
 volatile int    bytes_frame_pos_sended = 0;
+static unsigned char bytes_frame_hdr[WEBCAM_FRAME_HEADER_MAX_SIZE]; // header of the raw bytes frame
+volatile int    bytes_frame_hdr_len = WEBCAM_FRAME_HEADER_SIZE;
+static uint8_t  out_hdr_ver = 1;            // frame header version of the outgoing stream
+static uint32_t out_seq = 0;                // sequence number of the next outgoing frame
 volatile int32_t out_streaming_strm_id = -1;
 volatile bool   sending_finished = false;
+/* outgoing frames queue */
+static wc_frame_pool * out_frame_pool = NULL;   // frames waiting for the transmission
+static wc_frame * out_frame = NULL;             // frame under transmission
+static wc_frame * out_inflight_first = NULL;    // frames passed to the session but not sent yet
+static wc_frame * out_inflight_last = NULL;
+volatile int32_t out_inflight_sent = 0;         // sent bytes of the first frame in flight
+static h2pc_cb_out_frame_done out_frame_done_cb = NULL;
+static void * out_frame_done_data = NULL;
+static void __h2pc_os_queue_cancel();
+/* outgoing rate control */
+static bool out_rc_enabled = false;
+static h2pc_os_rate_config out_rc_cfg;
+static h2pc_os_rate out_rc;
+static h2pc_cb_out_rate out_rc_cb = NULL;
+static void * out_rc_data = NULL;
+static int64_t out_rc_last = 0;             // time of the last rate update
+static int64_t out_rc_last_decrease = 0;
+static uint32_t out_rc_bytes = 0;           // bytes sent since the last update
+static bool out_rc_backlog = false;         // sender had more data than the session took
+static bool out_rc_congested = false;       // a frame was late since the last update
+static int64_t out_rc_frame_start = 0;      // prepare time of the raw bytes frame
+static void __h2pc_rc_update();
 #endif
 
-/* response data */
-volatile int    resp_buffer_size = H2PC_INITIAL_RESP_BUFFER;  // current response content buffer size
-volatile int    resp_len = 0;               // current response content length
-static char * resp_buffer = NULL;           // current response content
-
 #ifdef CONFIG_WC_USE_IO_STREAMS
 /* incoming frames data */
 static SemaphoreHandle_t inc_frames_mux = NULL;
-volatile int    frame_buffer_size = 0;      // current frame content length
 volatile int    frame_body_size = 0;
+volatile int    frame_body_left = 0;        // bytes of the current frame body not received yet
 volatile int    frame_state = H2PC_FST_WAITING_START_OF_FRAME;
-static wc_frame * frame_buffer;
+static wc_ring * frame_buffer;              // incoming frame header reassembly ring
+static wc_frame * inc_frame = NULL;         // incoming frame under assembly
+volatile bool   inc_resync = true;          // search for the next frame header after a broken one
+volatile uint32_t inc_resyncs_cnt = 0;      // broken headers met
+volatile uint32_t inc_bytes_skipped = 0;    // bytes skipped while searching for a header
 static wc_frame_pool * inc_frame_pool;
+static wc_frame_fanout * inc_frame_fanout;
 static h2pc_cb_inc_frame_analyse inc_frame_analyser;
 static void * inc_frame_analyser_data;
 static int32_t   inc_streaming_strm_id = -1;
+static uint8_t  inc_hdr_ver = 1;            // frame header version of the incoming stream
+volatile int32_t inc_hdr_size = WEBCAM_FRAME_HEADER_SIZE;
+static uint32_t inc_hdr_seq = 0;            // v2 fields of the header under consumption
+static uint32_t inc_hdr_stamp = 0;
+static uint16_t inc_hdr_flags = 0;
+static uint32_t inc_seq_next = 0;           // expected sequence number
+static h2pc_is_stream_stats inc_stream_stats;
+/* receive window tuning */
+static bool     inc_wt_enabled = false;
+static int32_t  inc_wt_min = 0;
+static int32_t  inc_wt_max = 0;
+static h2pc_is_window_stats inc_wt;
+static int64_t  inc_wt_last = 0;            // time of the last window update
+static uint32_t inc_wt_bytes = 0;           // bytes received since the last update
+static uint8_t  inc_wt_stalls = 0;          // window growths without the throughput gain
+static void __h2pc_wt_update();
+/* optional analyser stage */
+static QueueHandle_t inc_analyser_queue = NULL;     // frames waiting for the analyser task
+static SemaphoreHandle_t inc_analyser_done = NULL;  // given by the analyser task on exit
+static h2pc_analyser_stats inc_analyser_stats;
 #endif
 
 /* messages pools */
@@ -75,8 +168,36 @@ static cJSON * incoming_msgs = NULL;
 static cJSON * outgoing_msgs = NULL;
 volatile int  incoming_msgs_pos = 0;         // helpers work with the pool of incoming msgs
 volatile int  incoming_msgs_size = 0;
+static h2pc_cb_next_msg im_dispatcher = NULL;   // gets the messages while they are received
+/* registered handler of the message kind */
+typedef struct h2pc_im_handler {
+    uint32_t hash;
+    char *   kind;
+    h2pc_cb_msg_handler handler;
+    void *   user_data;
+    struct h2pc_im_handler * next;
+} h2pc_im_handler;
+static h2pc_im_handler * im_handlers[H2PC_IM_HANDLERS_BUCKETS];
+/* batching of the outgoing msgs. the counters are under the outgoing msgs lock */
+static h2pc_om_batch_config om_batch_cfg;
+static h2pc_om_batch_stats om_batch_stats;
+static bool     om_batching = false;
+static uint32_t om_cnt = 0;                 // messages in the pool
+static uint32_t om_bytes = 0;               // serialized size of them. counted while batching
+static int64_t  om_first_at = 0;            // time the oldest message of the pool was added
+static volatile bool om_batch_in_flight = false;
+static uint32_t * om_batch_reason = NULL;   // stats of the batch in flight, counted when it is sent
+static uint32_t om_batch_age = 0;
+static bool     om_dirty = false;           // the pool is given out by h2pc_om_get_pool
+#define H2PC_OM_INDEX_SIZE 32
+static cJSON *  om_index[H2PC_OM_INDEX_SIZE]; // queued state updates by kind and target
+static bool im_dispatch_held = false;           // the dispatcher asked to stop - the rest is pooled
+static bool im_dispatching = false;             // the pool is being passed to the dispatcher
+static uint32_t im_pool_bytes = 0;              // text of the messages pooled for h2pc_im_proceed
+static uint32_t im_pool_dropped = 0;            // messages over H2PC_MAXIMUM_RESP_BUFFER
 
 volatile bool client_connected = false;
+static h2pc_settings sess_settings = H2PC_SETTINGS_DEFAULT;
 
 static const int PATH_LENGTH  = 256;
 static const int TOKEN_LENGTH = 128;
@@ -130,7 +251,73 @@ static void __consume_protocol_error(cJSON * resp) {
     ESP_LOGE(H2PC_TAG, "protocol error %d (%s)", h2pc_err_code, REST_RESPONSE_ERRORS[h2pc_err_code]);
 }
 
-int h2pc_req_authorize_sync(const char * name, const char * pwrd, const char * dev, cJSON * meta, bool is_own_meta) {
+/* requests. each one is started by its own start function
+   and completed by the finish function called with the response */
+
+/* runs the started request to the completion */
+static int __h2pc_req_exec(h2pc_req_ctx * ctx) {
+    h2pc_req_ctx_wait(ctx);
+    int ret = ctx->finish ? ctx->finish(ctx) : ESP_OK;
+    h2pc_req_ctx_free(ctx);
+    return ret;
+}
+
+/* the completion is called from the network task */
+static int __h2pc_req_async(h2pc_req_ctx * ctx, h2pc_cb_req_done on_done, void * user_data) {
+    ctx->on_done = on_done;
+    ctx->user_data = user_data;
+    int ret = h2pc_req_ctx_post(ctx, ctx->path);
+    if (ret != ESP_OK) {
+        /* nothing is in flight - the finish function releases the request data */
+        if (ctx->finish) ctx->finish(ctx);
+        h2pc_req_ctx_free(ctx);
+    }
+    return ret;
+}
+
+static int __h2pc_req_authorize_finish(h2pc_req_ctx * ctx) {
+    if (!h2pc_get_connected()) return H2PC_ERR_NOT_CONNECTED;
+
+    /* extract sid */
+    int res = ESP_OK;
+    cJSON * resp = h2pc_req_ctx_consume(ctx);
+    if (resp) {
+        cJSON * shash = cJSON_GetObjectItem(resp, JSON_RPC_SHASH);
+        if (shash) {
+            char * hash = shash->valuestring;
+            h2pc_sid = malloc(strlen(hash) + 1);
+            h2pc_protocol_errors = 0;
+            strcpy(h2pc_sid, hash);
+            strcpy(h2pc_last_stamp, REST_SYNC_MSG);
+        } else {
+            __consume_protocol_error(resp);
+            res = H2PC_ERR_PROTOCOL;
+        }
+        cJSON_Delete(resp);
+    }
+    return res;
+}
+
+/* sets the copy of src. src may be the current value */
+static void __h2pc_str_set(char ** dst, const char * src) {
+    char * v = NULL;
+    if (src) {
+        v = malloc(strlen(src) + 1);
+        if (v) strcpy(v, src);
+    }
+    if (*dst) free(*dst);
+    *dst = v;
+}
+
+static void __h2pc_str_clr(char ** dst, bool wipe) {
+    if (*dst) {
+        if (wipe) memset(*dst, 0, strlen(*dst));
+        free(*dst);
+    }
+    *dst = NULL;
+}
+
+static h2pc_req_ctx * __h2pc_req_authorize_start(const char * name, const char * pwrd, const char * dev, cJSON * meta, bool is_own_meta) {
     if (h2pc_sid) {
         free(h2pc_sid);
         h2pc_sid = NULL;
@@ -146,49 +333,48 @@ int h2pc_req_authorize_sync(const char * name, const char * pwrd, const char * d
     else
         cJSON_AddItemReferenceToObject(tosend, JSON_RPC_META, meta);
 
-    h2pc_prepare_to_send(tosend);
+    /* the connection manager authorizes again with the same data */
+    if (name != cm_name) __h2pc_str_set(&cm_name, name);
+    if (pwrd != cm_pwrd) {
+        __h2pc_str_clr(&cm_pwrd, true);
+        __h2pc_str_set(&cm_pwrd, pwrd);
+    }
+    if (dev != cm_dev) __h2pc_str_set(&cm_dev, dev);
+    if (cm_meta) cJSON_Delete(cm_meta);
+    cm_meta = meta ? cJSON_Duplicate(meta, true) : NULL;
+
+    h2pc_req_ctx * ctx = h2pc_req_ctx_new();
+    if (ctx) {
+        h2pc_req_ctx_prepare(ctx, tosend);
+        ctx->path = HTTP2_STREAMING_AUTH_PATH;
+        ctx->finish = &__h2pc_req_authorize_finish;
+    }
     cJSON_Delete(tosend);
-    h2pc_do_post(HTTP2_STREAMING_AUTH_PATH);
-    h2pc_wait_for_response();
+    return ctx;
+}
 
-    if (h2pc_get_connected()) {
-        /* extract sid */
-        int res = ESP_OK;
-        cJSON * resp = h2pc_consume_response_content();
-        if (resp) {
-            cJSON * shash = cJSON_GetObjectItem(resp, JSON_RPC_SHASH);
-            if (shash) {
-                char * hash = shash->valuestring;
-                h2pc_sid = malloc(strlen(hash) + 1);
-                h2pc_protocol_errors = 0;
-                strcpy(h2pc_sid, hash);
-                strcpy(h2pc_last_stamp, REST_SYNC_MSG);
-            } else {
-                __consume_protocol_error(resp);
-                res = H2PC_ERR_PROTOCOL;
-            }
-            cJSON_Delete(resp);
-        }
-        return res;
-    } else {
-        return H2PC_ERR_NOT_CONNECTED;
-    }
+int h2pc_req_authorize_sync(const char * name, const char * pwrd, const char * dev, cJSON * meta, bool is_own_meta) {
+    h2pc_req_ctx * ctx = __h2pc_req_authorize_start(name, pwrd, dev, meta, is_own_meta);
+    if (ctx == NULL) return ESP_ERR_NO_MEM;
+    h2pc_req_ctx_post(ctx, ctx->path);
+    return __h2pc_req_exec(ctx);
 }
 
-#ifdef CONFIG_WC_USE_IO_STREAMS
-int h2pc_req_get_streams_sync(h2pc_cb_stream_next_device on_next_device) {
-    if (!h2pc_sid) return ESP_ERR_INVALID_STATE;
+int h2pc_req_authorize_async(const char * name, const char * pwrd, const char * dev, cJSON * meta, bool is_own_meta,
+                             h2pc_cb_req_done on_done, void * user_data) {
+    if (!h2pc_net_is_running()) return ESP_ERR_INVALID_STATE;
+    h2pc_req_ctx * ctx = __h2pc_req_authorize_start(name, pwrd, dev, meta, is_own_meta);
+    if (ctx == NULL) return ESP_ERR_NO_MEM;
+    return __h2pc_req_async(ctx, on_done, user_data);
+}
 
+#ifdef CONFIG_WC_USE_IO_STREAMS
+static int __h2pc_req_get_streams_finish(h2pc_req_ctx * ctx) {
+    h2pc_cb_stream_next_device on_next_device = (h2pc_cb_stream_next_device) ctx->finish_data;
     int ret = ESP_OK;
 
-    cJSON * tosend = cJSON_CreateObject();
-    cJSON_AddStringToObject(tosend, JSON_RPC_SHASH, h2pc_sid);
-    h2pc_prepare_to_send(tosend);
-    cJSON_Delete(tosend);
-    h2pc_do_post(HTTP2_STREAMING_GETSTREAMS_PATH);
-    h2pc_wait_for_response();
     /* extract result */
-    cJSON * resp = h2pc_consume_response_content();
+    cJSON * resp = h2pc_req_ctx_consume(ctx);
     if (resp) {
         cJSON * result = cJSON_GetObjectItem(resp, JSON_RPC_RESULT);
         if (result &&
@@ -219,77 +405,279 @@ int h2pc_req_get_streams_sync(h2pc_cb_stream_next_device on_next_device) {
     }
     return ret;
 }
-#endif
 
-int h2pc_req_send_msgs_sync() {
+static h2pc_req_ctx * __h2pc_req_get_streams_start(h2pc_cb_stream_next_device on_next_device) {
+    h2pc_req_ctx * ctx = h2pc_req_ctx_new();
+    if (ctx == NULL) return NULL;
+
+    cJSON * tosend = cJSON_CreateObject();
+    cJSON_AddStringToObject(tosend, JSON_RPC_SHASH, h2pc_sid);
+    if (h2pc_req_ctx_prepare_json(ctx, tosend, true) != ESP_OK) {
+        h2pc_req_ctx_free(ctx);
+        return NULL;
+    }
+    ctx->path = HTTP2_STREAMING_GETSTREAMS_PATH;
+    ctx->finish = &__h2pc_req_get_streams_finish;
+    ctx->finish_data = (void *) on_next_device;
+    return ctx;
+}
+
+int h2pc_req_get_streams_sync(h2pc_cb_stream_next_device on_next_device) {
     if (!h2pc_sid) return ESP_ERR_INVALID_STATE;
-    if ((h2pc_mode & H2PC_MODE_MESSAGING) == 0) return ESP_ERR_INVALID_STATE;
 
-    int ret = ESP_OK;
+    h2pc_req_ctx * ctx = __h2pc_req_get_streams_start(on_next_device);
+    if (ctx == NULL) return ESP_ERR_NO_MEM;
+    h2pc_req_ctx_post(ctx, ctx->path);
+    return __h2pc_req_exec(ctx);
+}
+
+int h2pc_req_get_streams_async(h2pc_cb_stream_next_device on_next_device,
+                               h2pc_cb_req_done on_done, void * user_data) {
+    if (!h2pc_sid) return ESP_ERR_INVALID_STATE;
+    if (!h2pc_net_is_running()) return ESP_ERR_INVALID_STATE;
+
+    h2pc_req_ctx * ctx = __h2pc_req_get_streams_start(on_next_device);
+    if (ctx == NULL) return ESP_ERR_NO_MEM;
+    return __h2pc_req_async(ctx, on_done, user_data);
+}
+#endif
+
+/* last item of the array. cJSON keeps it in child->prev, the old versions do not */
+static cJSON * __h2pc_json_tail(cJSON * arr) {
+    cJSON * tail = arr->child->prev;
+    if (tail == NULL) {
+        tail = arr->child;
+        while (tail->next) tail = tail->next;
+    }
+    return tail;
+}
+
+/* serialized size of the message. it is kept in valueint, unused by cJSON for the objects */
+static uint32_t __h2pc_om_msg_size(cJSON * msg) {
+    if (msg->valueint <= 0) {
+        int len = wcJson_measure(msg);
+        msg->valueint = (len > 0) ? len : 0;
+    }
+    return msg->valueint;
+}
+
+/* kind and target of the plain state update. the responses and
+ * the requests waiting for them are never replaced */
+static bool __h2pc_om_update_key(const cJSON * item, const char ** kind, const char ** target) {
+    const cJSON * k = NULL, * t = NULL;
+    for (const cJSON * f = item->child; f; f = f->next) {
+        if (f->string == NULL) continue;
+        if (strcmp(f->string, JSON_RPC_MSG) == 0)    k = f; else
+        if (strcmp(f->string, JSON_RPC_TARGET) == 0) t = f; else
+        if (strcmp(f->string, JSON_RPC_RESULT) == 0) return false; else
+        if ((strcmp(f->string, JSON_RPC_PARAMS) == 0) && cJSON_GetObjectItem(f, JSON_RPC_MID))
+            return false;
+    }
+    if ((k == NULL) || (k->valuestring == NULL)) return false;
+    if (t && (t->valuestring == NULL)) return false;
+    *kind = k->valuestring;
+    *target = t ? t->valuestring : NULL;
+    return true;
+}
 
-    cJSON * outgoing_msgs_dub = NULL;
+/* slot of the queued update of the kind to the target or the free one, -1 if the index is full */
+static int __h2pc_om_index_slot(const char * kind, const char * target) {
+    uint32_t h = 5381;
+    for (const char * c = kind; *c; c++) h = h * 33 + (uint8_t) *c;
+    if (target)
+        for (const char * c = target; *c; c++) h = h * 33 + (uint8_t) *c;
+    for (int i = 0; i < H2PC_OM_INDEX_SIZE; i++) {
+        int slot = (h + i) % H2PC_OM_INDEX_SIZE;
+        if (om_index[slot] == NULL) return slot;
+        const char * k, * t;
+        if (__h2pc_om_update_key(om_index[slot], &k, &t) && (strcmp(k, kind) == 0) &&
+            ((target == NULL) ? (t == NULL) : (t && (strcmp(t, target) == 0))))
+            return slot;
+    }
+    return -1;
+}
+
+/* counts the pool again after it is replaced. the outgoing msgs are locked */
+static void __h2pc_om_recount() {
+    uint32_t cnt = 0, bytes = 0;
+    memset(om_index, 0, sizeof(om_index));
+    if (outgoing_msgs) {
+        for (cJSON * item = outgoing_msgs->child; item; item = item->next) {
+            cnt++;
+            if (om_batching) bytes += __h2pc_om_msg_size(item);
+            const char * k, * t;
+            if (om_batching && om_batch_cfg.coalesce && __h2pc_om_update_key(item, &k, &t)) {
+                /* the later update of the kind takes the slot */
+                int slot = __h2pc_om_index_slot(k, t);
+                if (slot >= 0) om_index[slot] = item;
+            }
+        }
+    }
+    /* the restored messages wait again, so the failed request is not repeated at once */
+    if ((om_cnt == 0) && (cnt > 0))
+        om_first_at = esp_timer_get_time();
+    om_cnt = cnt;
+    om_bytes = bytes;
+    om_dirty = false;
+}
+
+/* returns the not sent messages of the request to the head of the outgoing pool */
+static void __h2pc_om_restore(cJSON * tosend) {
+    cJSON * msgs = cJSON_DetachItemFromObject(tosend, JSON_RPC_MSGS);
+    if (msgs == NULL) return;
     if (h2pc_om_lock()) {
-        cJSON * outgoing_msgs = h2pc_om_get_pool();
-        if ((outgoing_msgs) && (cJSON_GetArraySize(outgoing_msgs) > 0)) {
-            /* dublicate outgoing data to restore on error */
-            outgoing_msgs_dub = cJSON_Duplicate(outgoing_msgs, true);
-            h2pc_om_clr_pool();
+        if ((outgoing_msgs == NULL) || (outgoing_msgs->child == NULL)) {
+            h2pc_om_set_pool(msgs);
+            msgs = NULL;
+        } else
+        if (msgs->child) {
+            /* the messages added meanwhile go after the restored ones */
+            cJSON * head = outgoing_msgs->child;
+            bool keeps_tail = (head->prev != NULL);
+            cJSON * tail = __h2pc_json_tail(outgoing_msgs);
+            cJSON * msgs_tail = __h2pc_json_tail(msgs);
+            msgs_tail->next = head;
+            head->prev = msgs_tail;
+            /* the head of the old versions has no prev */
+            msgs->child->prev = keeps_tail ? tail : NULL;
+            outgoing_msgs->child = msgs->child;
+            msgs->child = NULL;
+            __h2pc_om_recount();
         }
-        //
         h2pc_om_unlock();
     }
-    if (outgoing_msgs_dub) {
-        cJSON * tosend = cJSON_CreateObject();
-        cJSON_AddStringToObject(tosend, JSON_RPC_SHASH, h2pc_sid);
-        cJSON_AddItemToObject(tosend, JSON_RPC_MSGS, outgoing_msgs_dub);
-        h2pc_prepare_to_send(tosend);
+    if (msgs) cJSON_Delete(msgs);
+}
 
-        ESP_LOGI(H2PC_TAG, "sending msgs %d bytes", bytes_tosend_len);
+static int __h2pc_req_send_msgs_finish(h2pc_req_ctx * ctx) {
+    cJSON * tosend = (cJSON *) ctx->finish_data;
+    int ret = ESP_OK;
 
-        h2pc_do_post(HTTP2_STREAMING_ADDMSGS_PATH);
-        h2pc_wait_for_response();
-        /* extract result */
-        cJSON * resp  = h2pc_consume_response_content();
-        if (resp) {
-            cJSON * result = cJSON_GetObjectItem(resp, JSON_RPC_RESULT);
-            if (result &&
-                (strcmp(result->valuestring, JSON_RPC_OK) == 0)) {
-                ret = ESP_OK;
-            } else {
-                /* restore not-sended data */
-                if (h2pc_om_lock()) {
-                    cJSON * outgoing_msgs = h2pc_om_get_pool();
-                    if (outgoing_msgs) {
-                        while (cJSON_GetArraySize(outgoing_msgs_dub) > 0) {
-                            cJSON * item = cJSON_DetachItemFromArray(outgoing_msgs_dub, 0);
-                            cJSON_AddItemToArray(outgoing_msgs, item);
-                        }
-                    } else {
-                        h2pc_om_set_pool(cJSON_Duplicate(outgoing_msgs_dub, true));
-                    }
-                    h2pc_om_unlock();
-                }
-                __consume_protocol_error(resp);
-                ret = H2PC_ERR_PROTOCOL;
-            }
-            cJSON_Delete(resp);
+    /* extract result */
+    cJSON * resp  = h2pc_req_ctx_consume(ctx);
+    if (resp) {
+        cJSON * result = cJSON_GetObjectItem(resp, JSON_RPC_RESULT);
+        if (result &&
+            (strcmp(result->valuestring, JSON_RPC_OK) == 0)) {
+            ret = ESP_OK;
         } else {
-            ret = H2PC_ERR_INTERNAL;
+            /* restore not-sended data */
+            __h2pc_om_restore(tosend);
+            __consume_protocol_error(resp);
+            ret = H2PC_ERR_PROTOCOL;
         }
-        cJSON_Delete(tosend);
+        cJSON_Delete(resp);
+    } else {
+        /* no response - the connection is lost. the messages are sent again later */
+        __h2pc_om_restore(tosend);
+        ret = H2PC_ERR_INTERNAL;
     }
+    cJSON_Delete(tosend);
     return ret;
 }
 
-int h2pc_req_send_media_record_sync(const char * buf, size_t sz) {
+/* returns NULL with ret = ESP_OK if there is nothing to send */
+static h2pc_req_ctx * __h2pc_req_send_msgs_start(int * ret) {
+    *ret = ESP_OK;
+
+    cJSON * msgs = NULL;
+    if (h2pc_om_lock()) {
+        if ((outgoing_msgs) && (outgoing_msgs->child)) {
+            /* the request takes the pool, the producers start the new one */
+            msgs = outgoing_msgs;
+            outgoing_msgs = NULL;
+            om_cnt = 0;
+            om_bytes = 0;
+            memset(om_index, 0, sizeof(om_index));
+        }
+        //
+        h2pc_om_unlock();
+    }
+    if (msgs == NULL) return NULL;
+
+    cJSON * tosend = cJSON_CreateObject();
+    cJSON_AddStringToObject(tosend, JSON_RPC_SHASH, h2pc_sid);
+    cJSON_AddItemToObject(tosend, JSON_RPC_MSGS, msgs);
+
+    h2pc_req_ctx * ctx = h2pc_req_ctx_new();
+    if (ctx == NULL) {
+        __h2pc_om_restore(tosend);
+        cJSON_Delete(tosend);
+        *ret = H2PC_ERR_INTERNAL;
+        return NULL;
+    }
+    /* the request keeps the tree to restore the messages on error */
+    if (h2pc_req_ctx_prepare_json(ctx, tosend, false) != ESP_OK) {
+        __h2pc_om_restore(tosend);
+        cJSON_Delete(tosend);
+        h2pc_req_ctx_free(ctx);
+        *ret = H2PC_ERR_INTERNAL;
+        return NULL;
+    }
+    ctx->path = HTTP2_STREAMING_ADDMSGS_PATH;
+    ctx->finish = &__h2pc_req_send_msgs_finish;
+    ctx->finish_data = tosend;
+
+    ESP_LOGI(H2PC_TAG, "sending msgs %d bytes", ctx->tosend_len);
+    return ctx;
+}
+
+int h2pc_req_send_msgs_sync() {
     if (!h2pc_sid) return ESP_ERR_INVALID_STATE;
-    // prepare path?query string
+    if ((h2pc_mode & H2PC_MODE_MESSAGING) == 0) return ESP_ERR_INVALID_STATE;
+
+    int ret;
+    h2pc_req_ctx * ctx = __h2pc_req_send_msgs_start(&ret);
+    if (ctx == NULL) return ret;
+    h2pc_req_ctx_post(ctx, ctx->path);
+    return __h2pc_req_exec(ctx);
+}
+
+int h2pc_req_send_msgs_async(h2pc_cb_req_done on_done, void * user_data) {
+    if (!h2pc_sid) return ESP_ERR_INVALID_STATE;
+    if ((h2pc_mode & H2PC_MODE_MESSAGING) == 0) return ESP_ERR_INVALID_STATE;
+    if (!h2pc_net_is_running()) return ESP_ERR_INVALID_STATE;
+
+    int ret;
+    h2pc_req_ctx * ctx = __h2pc_req_send_msgs_start(&ret);
+    if (ctx == NULL) {
+        if ((ret == ESP_OK) && on_done) on_done(ESP_OK, user_data);
+        return ret;
+    }
+    return __h2pc_req_async(ctx, on_done, user_data);
+}
+
+static int __h2pc_req_send_media_record_finish(h2pc_req_ctx * ctx) {
+    if (!h2pc_get_connected()) return H2PC_ERR_NOT_CONNECTED;
+
     int ret = ESP_OK;
+    /* extract result */
+    cJSON * resp = h2pc_req_ctx_consume(ctx);
+    if (resp) {
+        cJSON * result = cJSON_GetObjectItem(resp, JSON_RPC_RESULT);
+        if (result &&
+            (strcmp(result->valuestring, JSON_RPC_OK) == 0)) {
+            ret = ESP_OK;
+        } else {
+            __consume_protocol_error(resp);
+            ret = H2PC_ERR_PROTOCOL;
+        }
+        cJSON_Delete(resp);
+    }
+    return ret;
+}
 
+static h2pc_req_ctx * __h2pc_req_send_media_record_start(const char * buf, size_t sz) {
+    // prepare path?query string
+    h2pc_req_ctx * ctx = NULL;
     char * aPath = NULL;
     char * aSID = NULL;
+    ctx = h2pc_req_ctx_new();
+    if (ctx == NULL) goto error_no_memory;
     aPath = malloc(PATH_LENGTH);
     if (aPath == NULL) goto error_no_memory;
+    ctx->path = aPath;
+    ctx->path_need_to_free = true;
     aSID    = malloc(TOKEN_LENGTH);
     if (aSID == NULL) goto error_no_memory;
     memset(aPath, 0, PATH_LENGTH);
@@ -298,177 +686,467 @@ int h2pc_req_send_media_record_sync(const char * buf, size_t sz) {
 
     sprintf(aPath, HTTP2_STREAMING_ADDREC_PATH, aSID);
 
-    h2pc_prepare_to_send_static((char *) buf, sz);
-    h2pc_do_post(aPath);
-    h2pc_wait_for_response();
-
-    if (h2pc_get_connected()) {
-        /* extract result */
-        cJSON * resp = h2pc_consume_response_content();
-        if (resp) {
-            cJSON * result = cJSON_GetObjectItem(resp, JSON_RPC_RESULT);
-            if (result &&
-                (strcmp(result->valuestring, JSON_RPC_OK) == 0)) {
-                ret = ESP_OK;
-            } else {
-                __consume_protocol_error(resp);
-                ret = H2PC_ERR_PROTOCOL;
-            }
-            cJSON_Delete(resp);
-        }
-    } else {
-        ret = H2PC_ERR_NOT_CONNECTED;
-    }
+    h2pc_req_ctx_prepare_static(ctx, (char *) buf, sz);
+    ctx->finish = &__h2pc_req_send_media_record_finish;
     goto final;
 error_no_memory:
-    ret = ESP_ERR_NO_MEM;
+    if (ctx) h2pc_req_ctx_free(ctx);
+    ctx = NULL;
 final:
     if (aSID) free(aSID);
-    if (aPath) free(aPath);
-    return ret;
+    return ctx;
 }
 
-int h2pc_req_get_msgs_sync() {
-    if ((h2pc_mode & H2PC_MODE_MESSAGING) == 0) return ESP_ERR_INVALID_STATE;
+int h2pc_req_send_media_record_sync(const char * buf, size_t sz) {
     if (!h2pc_sid) return ESP_ERR_INVALID_STATE;
-    if (!h2pc_last_stamp) return ESP_ERR_INVALID_STATE;
 
-    cJSON * tosend = cJSON_CreateObject();
-    cJSON_AddStringToObject(tosend, JSON_RPC_SHASH, h2pc_sid);
-    cJSON_AddStringToObject(tosend, JSON_RPC_STAMP, h2pc_last_stamp);
-    h2pc_prepare_to_send(tosend);
-    cJSON_Delete(tosend);
-    h2pc_do_post(HTTP2_STREAMING_GETMSGS_PATH);
-    h2pc_wait_for_response();
-    int ret = ESP_OK;
-    /* extract result */
-    if (h2pc_im_lock()) {
-        cJSON * resp = h2pc_consume_response_content();
-        incoming_msgs_size = 0;
-        incoming_msgs_pos = 0;
-        if (resp) {
-            cJSON * result = cJSON_GetObjectItem(resp, JSON_RPC_RESULT);
-            if (result &&
-                (strcmp(result->valuestring, JSON_RPC_OK) == 0)) {
-                cJSON* msgs = cJSON_DetachItemFromObject(resp, JSON_RPC_MSGS);
-                if (msgs) {
-                    incoming_msgs_size = cJSON_GetArraySize(msgs);
-                    incoming_msgs_pos = 0;
-                    h2pc_im_set_pool(msgs);
-                } else
-                    ret = H2PC_EMPTY_RESPONSE;
-            } else {
-                __consume_protocol_error(resp);
-                ret = H2PC_ERR_PROTOCOL;
-            }
-            cJSON_Delete(resp);
-        }
-        h2pc_im_unlock();
-    }
-    return ret;
+    h2pc_req_ctx * ctx = __h2pc_req_send_media_record_start(buf, sz);
+    if (ctx == NULL) return ESP_ERR_NO_MEM;
+    h2pc_req_ctx_post(ctx, ctx->path);
+    return __h2pc_req_exec(ctx);
 }
 
-void __h2pc_om_add_msg_full(const char * amsg, const char * atarget, cJSON * content, int error_code, bool add_res) {
-    if ((h2pc_mode & H2PC_MODE_MESSAGING) == 0) return;
+int h2pc_req_send_media_record_async(const char * buf, size_t sz,
+                                     h2pc_cb_req_done on_done, void * user_data) {
+    if (!h2pc_sid) return ESP_ERR_INVALID_STATE;
+    if (!h2pc_net_is_running()) return ESP_ERR_INVALID_STATE;
 
-    if (h2pc_om_lock()) {
-        cJSON * outgoing_msgs = h2pc_om_get_pool();
-        if (outgoing_msgs == NULL) {
-            outgoing_msgs = cJSON_CreateArray();
-            h2pc_om_set_pool(outgoing_msgs);
-        }
-        cJSON * msg = cJSON_CreateObject();
-        cJSON_AddStringToObject(msg, JSON_RPC_MSG, amsg);
-        if (atarget)
-            cJSON_AddStringToObject(msg, JSON_RPC_TARGET, atarget);
-        if (content)
-            cJSON_AddItemToObject(msg, JSON_RPC_PARAMS, content);
-
-        if (add_res)
-            h2pc_msg_set_res(msg, error_code);
-
-        cJSON_AddItemToArray(outgoing_msgs, msg);
-        //
-        h2pc_om_unlock();
+    h2pc_req_ctx * ctx = __h2pc_req_send_media_record_start(buf, sz);
+    if (ctx == NULL) return ESP_ERR_NO_MEM;
+    return __h2pc_req_async(ctx, on_done, user_data);
+}
+
+static uint32_t __h2pc_im_hash(const char * kind) {
+    /* FNV-1a */
+    uint32_t h = 2166136261u;
+    while (*kind) {
+        h ^= (uint8_t) *kind++;
+        h *= 16777619u;
     }
+    return h;
 }
 
-void h2pc_om_add_msg(const char * amsg, const char * atarget, cJSON * content) {
-    __h2pc_om_add_msg_full(amsg, atarget, content, REST_RESULT_OK, false);
+/* the incoming msgs are locked */
+static h2pc_im_handler * __h2pc_im_find_handler(const char * kind, uint32_t hash) {
+    h2pc_im_handler * h = im_handlers[hash % H2PC_IM_HANDLERS_BUCKETS];
+    while (h) {
+        if ((h->hash == hash) && (strcmp(h->kind, kind) == 0)) return h;
+        h = h->next;
+    }
+    return NULL;
 }
 
-void h2pc_om_add_msg_res(const char * amsg, const char * atarget, cJSON * content, bool ok) {
-    __h2pc_om_add_msg_full(amsg, atarget, content, ok ? REST_RESULT_OK : REST_ERR_UNSPECIFIED, true);
+/* the fields of the message and its handler */
+typedef struct {
+    const cJSON * ssrc;
+    const cJSON * skind;
+    const cJSON * spars;
+    const cJSON * smid;
+    h2pc_cb_msg_handler handler;
+    void *        user_data;
+} h2pc_im_call;
+
+/* resolves the message. false if it is not complete. the incoming msgs are locked */
+static bool __h2pc_im_resolve(const cJSON * msg, h2pc_im_call * c) {
+    const cJSON * stmp = NULL;
+    memset(c, 0, sizeof(h2pc_im_call));
+    /* the fields are resolved in one pass over the message */
+    for (const cJSON * f = msg->child; f; f = f->next) {
+        if (f->string == NULL) continue;
+        if (strcmp(f->string, JSON_RPC_DEVICE) == 0) c->ssrc  = f; else  //who sent
+        if (strcmp(f->string, JSON_RPC_MSG) == 0)    c->skind = f; else  //what sent
+        if (strcmp(f->string, JSON_RPC_STAMP) == 0)  stmp     = f; else  //when sent
+        if (strcmp(f->string, JSON_RPC_PARAMS) == 0) c->spars = f;       //params
+    }
+    if (stmp) strcpy(h2pc_last_stamp, stmp->valuestring);
+    if (c->spars) c->smid = cJSON_GetObjectItem(c->spars, JSON_RPC_MID); //msg id
+
+    /* check completeness */
+    if ((c->ssrc == NULL) || (c->skind == NULL)) return false;
+    if (c->skind->valuestring) {
+        h2pc_im_handler * h = __h2pc_im_find_handler(c->skind->valuestring,
+                                                     __h2pc_im_hash(c->skind->valuestring));
+        if (h) {
+            c->handler = h->handler;
+            c->user_data = h->user_data;
+        }
+    }
+    return true;
 }
 
-void h2pc_om_add_msg_res_code(const char * amsg, const char * atarget, cJSON * content, int error_code) {
-    __h2pc_om_add_msg_full(amsg, atarget, content, error_code, true);
+/* passes the pooled messages one by one. the callbacks are called without the lock,
+ * so they may use the messages api. returns false if a callback asks to stop */
+static bool __h2pc_im_drain(h2pc_cb_next_msg on_next_msg, int limit_cnt) {
+    int cnt = 0;
+    bool next = true;
+    while (next && (cnt <= limit_cnt)) {
+        cJSON * msg = NULL;
+        h2pc_im_call c;
+        bool complete = false;
+        if (!h2pc_im_lock()) break;
+        /* the pool is the fifo - the head is detached in O(1) */
+        if (incoming_msgs && incoming_msgs->child) {
+            msg = cJSON_DetachItemViaPointer(incoming_msgs, incoming_msgs->child);
+            if (incoming_msgs_size > 0) incoming_msgs_size--;
+            complete = __h2pc_im_resolve(msg, &c);
+        }
+        h2pc_im_unlock();
+        if (msg == NULL) break;
+
+        if (complete) {
+            if (c.handler)
+                next = c.handler(c.ssrc, c.spars, c.smid, c.user_data);
+            else
+            if (on_next_msg)
+                next = on_next_msg(c.ssrc, c.skind, c.spars, c.smid);
+            cnt++;
+        }
+        cJSON_Delete(msg);
+    }
+    if (h2pc_im_lock()) {
+        if (incoming_msgs && (incoming_msgs->child == NULL)) {
+            h2pc_im_clr_pool();
+            incoming_msgs_size = 0;
+        }
+        incoming_msgs_pos = 0;
+        h2pc_im_unlock();
+    }
+    return next;
 }
 
-void h2pc_im_proceed(h2pc_cb_next_msg on_next_msg, int limit_cnt) {
+/* passes the received messages to the dispatcher. no locks are held by the caller */
+static void __h2pc_im_dispatch_pool() {
     if ((h2pc_mode & H2PC_MODE_MESSAGING) == 0) return;
 
+    h2pc_cb_next_msg on_next_msg = NULL;
     if (h2pc_im_lock()) {
-        cJSON * incoming_msgs = h2pc_im_get_pool();
-        if (incoming_msgs && (incoming_msgs_pos < incoming_msgs_size)) {
-            int cnt = 0;
-            bool next = true;
-            while (next) {
-                cJSON * msg = cJSON_GetArrayItem(incoming_msgs, incoming_msgs_pos);
-
-                if (msg) {
-                    /* proceed message */
-                    cJSON * ssrc = cJSON_GetObjectItem(msg,  JSON_RPC_DEVICE);  //who sent
-                    cJSON * skind = cJSON_GetObjectItem(msg, JSON_RPC_MSG);     //what sent
-                    cJSON * stmp = cJSON_GetObjectItem(msg,  JSON_RPC_STAMP);   //when sent
-                    cJSON * spars = cJSON_GetObjectItem(msg, JSON_RPC_PARAMS);  //params
-                    if (stmp) strcpy(h2pc_last_stamp, stmp->valuestring);
-                    cJSON * smid;
-                    if (spars) {
-                        smid = cJSON_GetObjectItem(spars, JSON_RPC_MID); //msg id
-                    } else smid = NULL;
-
-                    /* check completeness */
-                    if (ssrc && skind) {
-                        if (on_next_msg)
-                            next = on_next_msg(ssrc, skind, spars, smid);
-                        cnt++;
-                    }
-                }
+        /* one task passes the messages at a time to keep their order */
+        if (im_dispatcher && !im_dispatch_held && !im_dispatching &&
+            incoming_msgs && incoming_msgs->child) {
+            on_next_msg = im_dispatcher;
+            im_dispatching = true;
+        }
+        h2pc_im_unlock();
+    }
+    if (on_next_msg == NULL) return;
 
-                incoming_msgs_pos++;
-                if (incoming_msgs_pos >= incoming_msgs_size) {
-                    h2pc_im_clr_pool();
-                    break;
-                }
-                if (cnt > limit_cnt)
-                    break;
-            }
+    bool next = __h2pc_im_drain(on_next_msg, INT32_MAX);
+    if (h2pc_im_lock()) {
+        im_dispatching = false;
+        if (!next) im_dispatch_held = true;
+        h2pc_im_unlock();
+    }
+}
 
+/* a message of the getMsgs response is received. the session is locked, so the
+ * message is only pooled - __h2pc_im_dispatch_pool passes it to the dispatcher */
+static bool __h2pc_im_on_item(void * user_data, char * item, size_t len) {
+    cJSON * msg = cJSON_Parse(item);
+    if (msg == NULL) {
+        ESP_LOGW(H2PC_TAG, "[get-msgs] Malformed message of %d bytes", len);
+        return true;
+    }
+    if (h2pc_im_lock()) {
+        if ((im_dispatcher == NULL) || im_dispatch_held) {
+            /* nobody takes the messages before the response is over -
+             * the pool is bounded as the response buffer was */
+            if (im_pool_bytes + len > H2PC_MAXIMUM_RESP_BUFFER) {
+                im_pool_dropped++;
+                h2pc_im_unlock();
+                cJSON_Delete(msg);
+                return true;
+            }
+            im_pool_bytes += len;
         }
+        if (incoming_msgs == NULL)
+            incoming_msgs = cJSON_CreateArray();
+        cJSON_AddItemToArray(incoming_msgs, msg);
+        incoming_msgs_size++;
         h2pc_im_unlock();
-    }
+    } else
+        cJSON_Delete(msg);
+    return true;
 }
 
-int h2pc_initialize(int mode) {
-    h2pc_mode = mode;
+static bool __h2pc_req_ctx_on_rest(void * user_data, const char * data, size_t len) {
+    return __h2pc_req_ctx_append((h2pc_req_ctx *) user_data, data, len);
+}
 
-    h2pc_last_stamp = malloc(128);
-    if (h2pc_last_stamp == NULL) return ESP_ERR_NO_MEM;
+static int __h2pc_req_get_msgs_finish(h2pc_req_ctx * ctx) {
+    int ret = ESP_OK;
+    /* the messages are passed already. the response keeps an empty array */
+    cJSON * resp = h2pc_req_ctx_consume(ctx);
+    /* extract result */
+    if (h2pc_im_lock()) {
+        if (ctx->splitter->dropped)
+            ESP_LOGW(H2PC_TAG, "[get-msgs] %d messages are too long", ctx->splitter->dropped);
+        if (im_pool_dropped)
+            ESP_LOGW(H2PC_TAG, "[get-msgs] %d messages are over the pool limit", im_pool_dropped);
+        im_pool_dropped = 0;
+        if (resp) {
+            cJSON * result = cJSON_GetObjectItem(resp, JSON_RPC_RESULT);
+            if (result &&
+                (strcmp(result->valuestring, JSON_RPC_OK) == 0)) {
+                if (cJSON_GetObjectItem(resp, JSON_RPC_MSGS) == NULL)
+                    ret = H2PC_EMPTY_RESPONSE;
+            } else {
+                __consume_protocol_error(resp);
+                ret = H2PC_ERR_PROTOCOL;
+            }
+            cJSON_Delete(resp);
+        }
+        h2pc_im_unlock();
+    } else
+    if (resp)
+        cJSON_Delete(resp);
+    /* the rest of the messages the network task did not pass yet */
+    __h2pc_im_dispatch_pool();
+    return ret;
+}
+
+static h2pc_req_ctx * __h2pc_req_get_msgs_start() {
+    h2pc_req_ctx * ctx = h2pc_req_ctx_new();
+    if (ctx == NULL) return NULL;
+
+    cJSON * tosend = cJSON_CreateObject();
+    cJSON_AddStringToObject(tosend, JSON_RPC_SHASH, h2pc_sid);
+    cJSON_AddStringToObject(tosend, JSON_RPC_STAMP, h2pc_last_stamp);
+    if (h2pc_req_ctx_prepare_json(ctx, tosend, true) != ESP_OK) {
+        h2pc_req_ctx_free(ctx);
+        return NULL;
+    }
+    /* the messages are parsed one by one. the ones not passed to the dispatcher
+     * are pooled up to H2PC_MAXIMUM_RESP_BUFFER bytes of their text */
+    ctx->splitter = wcJsonSplitter_init(JSON_RPC_MSGS, H2PC_MAXIMUM_RESP_BUFFER,
+                                        &__h2pc_im_on_item, &__h2pc_req_ctx_on_rest, ctx);
+    if (ctx->splitter == NULL) {
+        h2pc_req_ctx_free(ctx);
+        return NULL;
+    }
+    if (h2pc_im_lock()) {
+        /* the new response replaces the pool. the messages waiting
+         * for the dispatcher are kept */
+        if (im_dispatcher == NULL) {
+            h2pc_im_clr_pool();
+            incoming_msgs_size = 0;
+            incoming_msgs_pos = 0;
+        }
+        im_dispatch_held = false;
+        im_pool_bytes = 0;
+        im_pool_dropped = 0;
+        h2pc_im_unlock();
+    }
+    ctx->path = HTTP2_STREAMING_GETMSGS_PATH;
+    ctx->finish = &__h2pc_req_get_msgs_finish;
+    return ctx;
+}
+
+int h2pc_req_get_msgs_sync() {
+    if ((h2pc_mode & H2PC_MODE_MESSAGING) == 0) return ESP_ERR_INVALID_STATE;
+    if (!h2pc_sid) return ESP_ERR_INVALID_STATE;
+    if (!h2pc_last_stamp) return ESP_ERR_INVALID_STATE;
+
+    h2pc_req_ctx * ctx = __h2pc_req_get_msgs_start();
+    if (ctx == NULL) return ESP_ERR_NO_MEM;
+    h2pc_req_ctx_post(ctx, ctx->path);
+    return __h2pc_req_exec(ctx);
+}
+
+int h2pc_req_get_msgs_async(h2pc_cb_req_done on_done, void * user_data) {
+    if ((h2pc_mode & H2PC_MODE_MESSAGING) == 0) return ESP_ERR_INVALID_STATE;
+    if (!h2pc_sid) return ESP_ERR_INVALID_STATE;
+    if (!h2pc_last_stamp) return ESP_ERR_INVALID_STATE;
+    if (!h2pc_net_is_running()) return ESP_ERR_INVALID_STATE;
+
+    h2pc_req_ctx * ctx = __h2pc_req_get_msgs_start();
+    if (ctx == NULL) return ESP_ERR_NO_MEM;
+    return __h2pc_req_async(ctx, on_done, user_data);
+}
+
+int h2pc_om_set_batching(const h2pc_om_batch_config * cfg) {
+    if ((h2pc_mode & H2PC_MODE_MESSAGING) == 0) return ESP_ERR_INVALID_STATE;
+
+    if (h2pc_om_lock()) {
+        if (cfg) {
+            om_batch_cfg = *cfg;
+            om_batching = true;
+        } else
+            om_batching = false;
+        __h2pc_om_recount();
+        h2pc_om_unlock();
+    }
+    h2pc_wakeup();
+    return ESP_OK;
+}
+
+void h2pc_om_get_batch_stats(h2pc_om_batch_stats * stats) {
+    memset(stats, 0, sizeof(h2pc_om_batch_stats));
+    if ((h2pc_mode & H2PC_MODE_MESSAGING) == 0) return;
+
+    if (h2pc_om_lock()) {
+        *stats = om_batch_stats;
+        h2pc_om_unlock();
+    }
+}
+
+void __h2pc_om_add_msg_full(const char * amsg, const char * atarget, cJSON * content, int error_code, bool add_res) {
+    if ((h2pc_mode & H2PC_MODE_MESSAGING) == 0) return;
+
+    cJSON * msg = cJSON_CreateObject();
+    cJSON_AddStringToObject(msg, JSON_RPC_MSG, amsg);
+    if (atarget)
+        cJSON_AddStringToObject(msg, JSON_RPC_TARGET, atarget);
+    if (content)
+        cJSON_AddItemToObject(msg, JSON_RPC_PARAMS, content);
+
+    if (add_res)
+        h2pc_msg_set_res(msg, error_code);
+
+    /* the size is measured out of the lock and kept with the message */
+    if (om_batching) __h2pc_om_msg_size(msg);
+
+    if (h2pc_om_lock()) {
+        if (outgoing_msgs == NULL)
+            h2pc_om_set_pool(cJSON_CreateArray());
+        else
+        if (om_dirty)
+            __h2pc_om_recount();
+
+        uint32_t sz = om_batching ? __h2pc_om_msg_size(msg) : 0;
+        cJSON * old = NULL;
+        int slot = -1;
+        const char * k, * t;
+        if (om_batching && om_batch_cfg.coalesce && __h2pc_om_update_key(msg, &k, &t)) {
+            slot = __h2pc_om_index_slot(k, t);
+            if (slot >= 0) old = om_index[slot];
+        }
+        if (slot >= 0) om_index[slot] = msg;
+        if (old) {
+            /* the latest state takes the place of the queued one */
+            om_bytes -= __h2pc_om_msg_size(old);
+            om_bytes += sz;
+            cJSON_ReplaceItemViaPointer(outgoing_msgs, old, msg);
+            om_batch_stats.coalesced++;
+        } else {
+            if (om_cnt == 0) om_first_at = esp_timer_get_time();
+            cJSON_AddItemToArray(outgoing_msgs, msg);
+            om_cnt++;
+            om_bytes += sz;
+        }
+        //
+        h2pc_om_unlock();
+        h2pc_wakeup();
+    } else
+        cJSON_Delete(msg);
+}
+
+void h2pc_om_add_msg(const char * amsg, const char * atarget, cJSON * content) {
+    __h2pc_om_add_msg_full(amsg, atarget, content, REST_RESULT_OK, false);
+}
+
+void h2pc_om_add_msg_res(const char * amsg, const char * atarget, cJSON * content, bool ok) {
+    __h2pc_om_add_msg_full(amsg, atarget, content, ok ? REST_RESULT_OK : REST_ERR_UNSPECIFIED, true);
+}
+
+void h2pc_om_add_msg_res_code(const char * amsg, const char * atarget, cJSON * content, int error_code) {
+    __h2pc_om_add_msg_full(amsg, atarget, content, error_code, true);
+}
+
+void h2pc_im_set_dispatcher(h2pc_cb_next_msg on_next_msg) {
+    if (h2pc_im_lock()) {
+        im_dispatcher = on_next_msg;
+        im_dispatch_held = false;
+        h2pc_im_unlock();
+    }
+}
+
+int h2pc_im_register_handler(const char * kind, h2pc_cb_msg_handler handler, void * user_data) {
+    if ((kind == NULL) || (handler == NULL)) return ESP_ERR_INVALID_ARG;
+    if ((h2pc_mode & H2PC_MODE_MESSAGING) == 0) return ESP_ERR_INVALID_STATE;
+
+    int ret = ESP_OK;
+    if (h2pc_im_lock()) {
+        uint32_t hash = __h2pc_im_hash(kind);
+        h2pc_im_handler * h = __h2pc_im_find_handler(kind, hash);
+        if (h == NULL) {
+            h = malloc(sizeof(h2pc_im_handler));
+            if (h) h->kind = strdup(kind);
+            if ((h == NULL) || (h->kind == NULL)) {
+                if (h) free(h);
+                h2pc_im_unlock();
+                return ESP_ERR_NO_MEM;
+            }
+            h->hash = hash;
+            h->next = im_handlers[hash % H2PC_IM_HANDLERS_BUCKETS];
+            im_handlers[hash % H2PC_IM_HANDLERS_BUCKETS] = h;
+        }
+        h->handler = handler;
+        h->user_data = user_data;
+        h2pc_im_unlock();
+    }
+    return ret;
+}
+
+void h2pc_im_unregister_handler(const char * kind) {
+    if (kind == NULL) return;
+    if ((h2pc_mode & H2PC_MODE_MESSAGING) == 0) return;
+
+    if (h2pc_im_lock()) {
+        uint32_t hash = __h2pc_im_hash(kind);
+        h2pc_im_handler ** p = &(im_handlers[hash % H2PC_IM_HANDLERS_BUCKETS]);
+        while (*p) {
+            h2pc_im_handler * h = *p;
+            if ((h->hash == hash) && (strcmp(h->kind, kind) == 0)) {
+                *p = h->next;
+                free(h->kind);
+                free(h);
+                break;
+            }
+            p = &(h->next);
+        }
+        h2pc_im_unlock();
+    }
+}
+
+void h2pc_im_proceed(h2pc_cb_next_msg on_next_msg, int limit_cnt) {
+    if ((h2pc_mode & H2PC_MODE_MESSAGING) == 0) return;
+
+    __h2pc_im_drain(on_next_msg, limit_cnt);
+}
+
+int h2pc_initialize(int mode) {
+    h2pc_mode = mode;
+
+    if (h2pc_wake_fd < 0) {
+        /* the vfs may be registered already by the application */
+        esp_vfs_eventfd_config_t config = ESP_VFS_EVENTD_CONFIG_DEFAULT();
+        esp_err_t err = esp_vfs_eventfd_register(&config);
+        if ((err == ESP_OK) || (err == ESP_ERR_INVALID_STATE))
+            h2pc_wake_fd = eventfd(0, 0);
+        else
+            ESP_LOGW(H2PC_TAG, "Eventfd vfs registration failed %d", err);
+        if (h2pc_wake_fd < 0)
+            ESP_LOGW(H2PC_TAG, "Eventfd is not available. Socket wait can not be interrupted");
+    }
+
+    h2pc_last_stamp = malloc(128);
+    if (h2pc_last_stamp == NULL) return ESP_ERR_NO_MEM;
     h2pc_last_stamp[0] = 0;
 
-    /* allocating responsing content */
-    resp_buffer = malloc(resp_buffer_size);
-    if (resp_buffer == NULL) return ESP_ERR_NO_MEM;
+    h2pc_sess_mux = xSemaphoreCreateRecursiveMutex();
+    if (h2pc_sess_mux == NULL) return ESP_ERR_NO_MEM;
 
-    resp_len = 0;
+    /* allocating responsing content */
+    req_def = h2pc_req_ctx_new();
+    if (req_def == NULL) return ESP_ERR_NO_MEM;
 
 #ifdef CONFIG_WC_USE_IO_STREAMS
     if (mode & H2PC_MODE_INCOMING) {
         inc_frame_pool = NULL;
+        inc_frame_fanout = NULL;
         inc_frame_analyser = NULL;
         inc_frame_analyser_data = NULL;
-        frame_buffer = wcFrame_init();
+        frame_buffer = wcRing_init(H2PC_FRAME_HEADER_RING_SIZE);
         if (frame_buffer == NULL) return ESP_ERR_NO_MEM;
         inc_frames_mux = xSemaphoreCreateMutex();
         if (inc_frames_mux == NULL) return ESP_ERR_NO_MEM;
@@ -568,17 +1246,25 @@ bool h2pc_om_lock() {
 }
 
 cJSON * h2pc_om_get_pool() {
+    /* the caller may change the pool - it is counted again by the next add */
+    om_dirty = true;
     return outgoing_msgs;
 }
 
 void h2pc_om_clr_pool() {
     if (outgoing_msgs) cJSON_Delete(outgoing_msgs);
     outgoing_msgs = NULL;
+    om_cnt = 0;
+    om_bytes = 0;
+    memset(om_index, 0, sizeof(om_index));
+    om_dirty = false;
 }
 
 void h2pc_om_set_pool(cJSON * data) {
     if (outgoing_msgs) cJSON_Delete(outgoing_msgs);
     outgoing_msgs = data;
+    om_cnt = 0;
+    __h2pc_om_recount();
 }
 
 void h2pc_om_unlock() {
@@ -589,7 +1275,7 @@ bool h2pc_im_locked_waiting() {
     bool val = true;
     if (xSemaphoreTake(incoming_msgs_mux, portMAX_DELAY) == pdTRUE) {
         if (incoming_msgs)
-          val = cJSON_GetArraySize(incoming_msgs) == 0;
+          val = (incoming_msgs->child == NULL);
         xSemaphoreGive(incoming_msgs_mux);
     }
     return val;
@@ -598,18 +1284,16 @@ bool h2pc_im_locked_waiting() {
 bool h2pc_om_locked_waiting() {
     bool val = false;
     if (xSemaphoreTake(outgoing_msgs_mux, portMAX_DELAY) == pdTRUE) {
-        val = (outgoing_msgs) && (cJSON_GetArraySize(outgoing_msgs) > 0);
+        val = (outgoing_msgs) && (outgoing_msgs->child);
         xSemaphoreGive(outgoing_msgs_mux);
     }
     return val;
 }
 
 void h2pc_reset_buffers() {
-    resp_len = 0;
-    if (bytes_need_to_free && bytes_tosend) {
-        free(bytes_tosend);
-        bytes_tosend = NULL;
-        bytes_need_to_free = false;
+    if (req_def) {
+        req_def->resp_len = 0;
+        __h2pc_req_ctx_free_tosend(req_def);
     }
 #ifdef CONFIG_WC_USE_IO_STREAMS
     if (bytes_frame) {
@@ -619,30 +1303,83 @@ void h2pc_reset_buffers() {
 #endif
 }
 
+#ifdef CONFIG_WC_USE_IO_STREAMS
+static void __h2pc_is_reset_parser() {
+    frame_body_size = 0;
+    frame_body_left = 0;
+    frame_state = H2PC_FST_WAITING_START_OF_FRAME;
+    if (frame_buffer) wcRing_clear(frame_buffer);
+    if (inc_frame) wcFrame_free(inc_frame);
+    inc_frame = NULL;
+}
+#endif
+
 void h2pc_reset() {
     h2pc_reset_buffers();
     h2pc_protocol_errors = 0;
     h2pc_err_code = 0;
 #ifdef CONFIG_WC_USE_IO_STREAMS
     h2pc_is_set_pool(NULL, NULL, NULL);
-    frame_buffer_size = 0;
-    frame_body_size = 0;
-    frame_state = H2PC_FST_WAITING_START_OF_FRAME;
-    if (frame_buffer) wcFrame_clear(frame_buffer);
+    h2pc_is_set_fanout(NULL);
+    __h2pc_is_reset_parser();
 #endif
     if (h2pc_sid) free(h2pc_sid);
     h2pc_sid = NULL;
 }
 
 void h2pc_finalize() {
+    h2pc_cm_stop();
+    if (cm_kick) vSemaphoreDelete(cm_kick);
+    if (cm_done) vSemaphoreDelete(cm_done);
+    cm_kick = NULL;
+    cm_done = NULL;
+    __h2pc_str_clr(&cm_server, false);
+    __h2pc_str_clr(&cm_name, false);
+    __h2pc_str_clr(&cm_pwrd, true);
+    __h2pc_str_clr(&cm_dev, false);
+    if (cm_meta) cJSON_Delete(cm_meta);
+    cm_meta = NULL;
+#ifdef CONFIG_WC_USE_IO_STREAMS
+    __h2pc_str_clr(&cm_inc_device, false);
+    __h2pc_str_clr(&cm_out_subproto, false);
+    cm_out_active = false;
+#endif
+    h2pc_net_stop();
+    if (net_done) vSemaphoreDelete(net_done);
+    net_done = NULL;
+#ifdef CONFIG_WC_USE_IO_STREAMS
+    h2pc_is_stop_analyser();
+    h2pc_os_stop_queue();
+#endif
     h2pc_reset();
 
     if (incoming_msgs) cJSON_Delete(incoming_msgs);
     if (outgoing_msgs) cJSON_Delete(outgoing_msgs);
+    for (int i = 0; i < H2PC_IM_HANDLERS_BUCKETS; i++) {
+        while (im_handlers[i]) {
+            h2pc_im_handler * h = im_handlers[i];
+            im_handlers[i] = h->next;
+            free(h->kind);
+            free(h);
+        }
+    }
+    im_dispatcher = NULL;
+    im_dispatching = false;
+    om_batching = false;
+    om_cnt = 0;
+    om_bytes = 0;
+    memset(om_index, 0, sizeof(om_index));
+    om_dirty = false;
 #ifdef CONFIG_WC_USE_IO_STREAMS
-    if (frame_buffer)  wcFrame_free(frame_buffer);
+    if (frame_buffer)  wcRing_free(frame_buffer);
 #endif
     if (h2pc_last_stamp) free(h2pc_last_stamp);
+    if (req_def) h2pc_req_ctx_free(req_def);
+    req_def = NULL;
+    if (h2pc_sess_mux) vSemaphoreDelete(h2pc_sess_mux);
+    h2pc_sess_mux = NULL;
+    if (h2pc_wake_fd >= 0) close(h2pc_wake_fd);
+    h2pc_wake_fd = -1;
     if (incoming_msgs_mux) vSemaphoreDelete(incoming_msgs_mux);
     if (outgoing_msgs_mux) vSemaphoreDelete(outgoing_msgs_mux);
 
@@ -656,173 +1393,684 @@ void h2pc_finalize() {
     outgoing_msgs_mux = NULL;
 }
 
-void h2pc_disconnect_http2() {
+/* closes the session. the requests in flight are completed */
+static void __h2pc_sess_close() {
     if (client_connected) {
+        __h2pc_sess_lock();
+        /* the requests in flight are completed without the response */
+        while (req_ctxs)
+            __h2pc_req_complete(req_ctxs);
+#ifdef CONFIG_WC_USE_IO_STREAMS
+        __h2pc_os_queue_cancel();
+#endif
         sh2lib_free(&hd);
+        sess_lost = false;
+        __h2pc_sess_unlock();
 #ifdef CONFIG_WC_USE_IO_STREAMS
         out_streaming_strm_id = -1;
         inc_streaming_strm_id = -1;
 #endif
         client_connected = false;
     }
+}
+
+void h2pc_disconnect_http2() {
+    __h2pc_sess_close();
+#ifdef CONFIG_WC_USE_IO_STREAMS
+    /* the streams closed by the owner are not reopened */
+    __h2pc_str_clr(&cm_inc_device, false);
+    cm_out_active = false;
+#endif
     h2pc_reset();
 }
 
+/* the session failed. the connection manager recovers it if it is running */
+static void __h2pc_conn_lost() {
+    if (!cm_running) {
+        h2pc_disconnect_http2();
+        return;
+    }
+    if (!client_connected) return;
+    __h2pc_sess_close();
+    h2pc_reset_buffers();
+#ifdef CONFIG_WC_USE_IO_STREAMS
+    if ((h2pc_mode & H2PC_MODE_INCOMING) && __inc_frames_lock()) {
+        __h2pc_is_reset_parser();
+        __inc_frames_unlock();
+    }
+#endif
+    if (h2pc_sid) free(h2pc_sid);
+    h2pc_sid = NULL;
+    if (!cm_lost) {
+        cm_lost = true;
+        cm_lost_at = esp_timer_get_time();
+        if (__h2pc_sess_lock()) {
+            cm_stats.disconnects++;
+            __h2pc_sess_unlock();
+        }
+    }
+    xSemaphoreGive(cm_kick);
+}
+
+static bool __h2pc_sess_lock() {
+    return (xSemaphoreTakeRecursive(h2pc_sess_mux, portMAX_DELAY) == pdTRUE);
+}
+
+static void __h2pc_sess_unlock() {
+    xSemaphoreGiveRecursive(h2pc_sess_mux);
+}
+
+/* sends the local SETTINGS and the connection window. the session is locked */
+static void __h2pc_sess_apply_settings() {
+    nghttp2_settings_entry iv[3];
+    int cnt = 0;
+    if (sess_settings.initial_window_size > 0) {
+        iv[cnt].settings_id = NGHTTP2_SETTINGS_INITIAL_WINDOW_SIZE;
+        iv[cnt++].value = sess_settings.initial_window_size;
+    }
+    if (sess_settings.max_frame_size > 0) {
+        uint32_t v = sess_settings.max_frame_size;
+        if (v < NGHTTP2_MAX_FRAME_SIZE_MIN) v = NGHTTP2_MAX_FRAME_SIZE_MIN;
+        if (v > NGHTTP2_MAX_FRAME_SIZE_MAX) v = NGHTTP2_MAX_FRAME_SIZE_MAX;
+        iv[cnt].settings_id = NGHTTP2_SETTINGS_MAX_FRAME_SIZE;
+        iv[cnt++].value = v;
+    }
+    if (sess_settings.header_table_size > 0) {
+        iv[cnt].settings_id = NGHTTP2_SETTINGS_HEADER_TABLE_SIZE;
+        iv[cnt++].value = sess_settings.header_table_size;
+    }
+    if (cnt > 0) {
+        if (nghttp2_submit_settings(hd.http2_sess, NGHTTP2_FLAG_NONE, iv, cnt) != 0)
+            ESP_LOGE(H2PC_TAG, "Failed to submit settings");
+    }
+    if (sess_settings.connection_window_size > 0) {
+        if (nghttp2_session_set_local_window_size(hd.http2_sess, NGHTTP2_FLAG_NONE, 0,
+                                                  sess_settings.connection_window_size) != 0)
+            ESP_LOGE(H2PC_TAG, "Failed to set the connection window");
+    }
+}
+
+/* the session is locked */
+static void __h2pc_stream_set_weight(int32_t strm_id, int32_t weight) {
+    if ((strm_id <= 0) || (weight <= 0) || (hd.http2_sess == NULL)) return;
+    if (weight > NGHTTP2_MAX_WEIGHT) weight = NGHTTP2_MAX_WEIGHT;
+    nghttp2_priority_spec spec;
+    nghttp2_priority_spec_init(&spec, 0, weight, 0);
+    nghttp2_submit_priority(hd.http2_sess, NGHTTP2_FLAG_NONE, strm_id, &spec);
+}
+
 bool h2pc_connect_to_http2(char * aserver) {
+    return h2pc_connect_to_http2_ext(aserver, NULL);
+}
+
+bool h2pc_connect_to_http2_ext(char * aserver, const h2pc_settings * settings) {
     /* HTTP2: one connection multiple requests. Do the TLS/TCP connection first */
     ESP_LOGI(H2PC_TAG, "Connecting to server: %s", aserver);
+    if (aserver != cm_server)
+        __h2pc_str_set(&cm_server, aserver);
+    if (settings)
+        sess_settings = *settings;
     if (sh2lib_connect(&hd, aserver) != 0) {
         ESP_LOGE(H2PC_TAG, "Failed to connect");
         return false;
     }
+#ifdef CONFIG_H2PC_DATA_NO_COPY
+    if (__h2pc_sess_recreate() != ESP_OK) {
+        ESP_LOGE(H2PC_TAG, "Failed to create the session");
+        sh2lib_free(&hd);
+        return false;
+    }
+#endif
+    if (__h2pc_sess_lock()) {
+        sess_lost = false;
+        __h2pc_sess_apply_settings();
+        __h2pc_sess_unlock();
+    }
     ESP_LOGI(H2PC_TAG, "Connection done");
 
     client_connected = true;
     return true;
 }
 
-void h2pc_prepare_to_send(cJSON * tosend) {
-    bytes_tosend = cJSON_PrintUnformatted(tosend);
-    bytes_tosend_len = strlen(bytes_tosend);
-    bytes_tosend_pos = 0;
-    bytes_need_to_free = true;
-    request_finished = false;
+void h2pc_wakeup() {
+    if (h2pc_wake_fd >= 0) {
+        uint64_t v = 1;
+        write(h2pc_wake_fd, &v, sizeof(v));
+    }
 }
 
-void h2pc_prepare_to_send_static(char * buf, int size) {
-    bytes_tosend = buf;
-    bytes_tosend_len = size;
-    bytes_tosend_pos = 0;
-    bytes_need_to_free = false;
-    request_finished = false;
+#ifdef CONFIG_H2PC_DATA_NO_COPY
+/* writes all the data to tls. waits for the socket while tls wants io */
+static int __h2pc_tls_write(const void * data, size_t len) {
+    const unsigned char * p = (const unsigned char *) data;
+    while (len > 0) {
+        if (hd.http2_tls == NULL) return ESP_FAIL;
+        ssize_t wr = esp_tls_conn_write(hd.http2_tls, p, len);
+        if ((wr == ESP_TLS_ERR_SSL_WANT_WRITE) || (wr == ESP_TLS_ERR_SSL_WANT_READ)) {
+            int sockfd = -1;
+            if (esp_tls_get_conn_sockfd(hd.http2_tls, &sockfd) != ESP_OK) return ESP_FAIL;
+            fd_set wfds;
+            FD_ZERO(&wfds);
+            FD_SET(sockfd, &wfds);
+            struct timeval tv;
+            tv.tv_sec = H2PC_IO_WAIT_MS / 1000;
+            tv.tv_usec = (H2PC_IO_WAIT_MS % 1000) * 1000;
+            if (select(sockfd + 1, NULL, &wfds, NULL, &tv) < 0) return ESP_FAIL;
+            continue;
+        }
+        if (wr <= 0) {
+            ESP_LOGE(H2PC_TAG, "[data-prvd] tls write failed %d", (int) wr);
+            return ESP_FAIL;
+        }
+        p += wr;
+        len -= wr;
+    }
+    return ESP_OK;
 }
 
-#ifdef CONFIG_WC_USE_IO_STREAMS
-void h2pc_os_prepare_frame(char * buf, int size) {
-    bytes_frame = buf;
-    bytes_frame_len = size + WEBCAM_FRAME_HEADER_SIZE;
-    bytes_frame_pos = 0;
-    bytes_frame_pos_sended = 0;
-    sending_finished = false;
+/* the session callbacks. they pass the events to the stream callbacks
+ * of sh2lib_do_get/put/post as sh2lib does */
+static ssize_t __h2pc_sess_send(nghttp2_session *session, const uint8_t *data, size_t length,
+                                int flags, void *user_data) {
+    struct sh2lib_handle * h = (struct sh2lib_handle *) user_data;
+    ssize_t wr = esp_tls_conn_write(h->http2_tls, data, length);
+    if (wr <= 0) {
+        if ((wr == ESP_TLS_ERR_SSL_WANT_WRITE) || (wr == ESP_TLS_ERR_SSL_WANT_READ))
+            return NGHTTP2_ERR_WOULDBLOCK;
+        return NGHTTP2_ERR_CALLBACK_FAILURE;
+    }
+    return wr;
 }
 
-void truncateFrameBuffer(int32_t * BP) {
-    if (*BP > 0) {
-        if ((frame_buffer_size - *BP) > 0)
-        {
-            frame_buffer_size = frame_buffer_size - *BP;
-            memmove(frame_buffer->data, frame_buffer->data + *BP, frame_buffer_size);
-        }
-        else
-            frame_buffer_size = 0;
-        *BP = 0;
+static ssize_t __h2pc_sess_recv(nghttp2_session *session, uint8_t *buf, size_t length,
+                                int flags, void *user_data) {
+    struct sh2lib_handle * h = (struct sh2lib_handle *) user_data;
+    ssize_t rd = esp_tls_conn_read(h->http2_tls, buf, length);
+    if (rd < 0) {
+        if ((rd == ESP_TLS_ERR_SSL_WANT_WRITE) || (rd == ESP_TLS_ERR_SSL_WANT_READ))
+            return NGHTTP2_ERR_WOULDBLOCK;
+        return NGHTTP2_ERR_CALLBACK_FAILURE;
     }
+    if (rd == 0) return NGHTTP2_ERR_EOF;
+    return rd;
 }
 
-int32_t bufferFreeSize() {
-    return H2PC_MAX_ALLOWED_FRAMES_SIZE - frame_buffer_size;
+static int __h2pc_sess_on_frame_send(nghttp2_session *session, const nghttp2_frame *frame,
+                                     void *user_data) {
+    if (frame->hd.type != NGHTTP2_DATA) return 0;
+    sh2lib_frame_data_recv_cb_t cb = nghttp2_session_get_stream_user_data(session, frame->hd.stream_id);
+    if (cb) {
+        size_t len = frame->hd.length;
+        cb((struct sh2lib_handle *) user_data, frame->hd.stream_id, (const char *) &len, 0, DATA_SEND_FRAME_DATA);
+    }
+    return 0;
 }
 
-void pushFrame(int32_t aStartAt) {
-    wc_frame * aFrame = wcFrame_init();
-    frame_buffer->pos = aStartAt;
+static int __h2pc_sess_on_frame_recv(nghttp2_session *session, const nghttp2_frame *frame,
+                                     void *user_data) {
+    if (frame->hd.type == NGHTTP2_GOAWAY) {
+        /* the session can not be freed inside its callbacks */
+        sess_lost = true;
+        return 0;
+    }
+    if (((frame->hd.type == NGHTTP2_DATA) || (frame->hd.type == NGHTTP2_HEADERS)) &&
+        (frame->hd.flags & NGHTTP2_FLAG_END_STREAM)) {
+        sh2lib_frame_data_recv_cb_t cb = nghttp2_session_get_stream_user_data(session, frame->hd.stream_id);
+        if (cb)
+            cb((struct sh2lib_handle *) user_data, frame->hd.stream_id, NULL, 0, DATA_RECV_FRAME_COMPLETE);
+    }
+    return 0;
+}
 
-    if (aFrame == NULL) return;
+static int __h2pc_sess_on_stream_close(nghttp2_session *session, int32_t stream_id,
+                                       uint32_t error_code, void *user_data) {
+    sh2lib_frame_data_recv_cb_t cb = nghttp2_session_get_stream_user_data(session, stream_id);
+    if (cb)
+        cb((struct sh2lib_handle *) user_data, stream_id, NULL, 0, DATA_RECV_RST_STREAM);
+    return 0;
+}
 
-    wcFrame_writeData(aFrame, frame_buffer->data + frame_buffer->pos, frame_body_size + WEBCAM_FRAME_HEADER_SIZE);
-    aFrame->pos = 0;
+static int __h2pc_sess_on_data_chunk(nghttp2_session *session, uint8_t flags, int32_t stream_id,
+                                     const uint8_t *data, size_t len, void *user_data) {
+    sh2lib_frame_data_recv_cb_t cb = nghttp2_session_get_stream_user_data(session, stream_id);
+    if (cb)
+        cb((struct sh2lib_handle *) user_data, stream_id, (const char *) data, len, 0);
+    return 0;
+}
 
-    if (__inc_frames_lock()) {
-        if (inc_frame_pool) {
-            bool flag = true;
-            if (inc_frame_analyser)
-                flag = inc_frame_analyser(inc_frame_analyser_data, aFrame, WEBCAM_FRAME_HEADER_SIZE);
+/* the session of sh2lib_connect has no send_data_callback and nghttp2 can not
+ * set it later, so the session is created again before anything is sent.
+ * the tls connection of sh2lib is kept */
+static int __h2pc_sess_recreate() {
+    nghttp2_session_callbacks * callbacks;
+    if (nghttp2_session_callbacks_new(&callbacks) != 0) return ESP_ERR_NO_MEM;
+    nghttp2_session_callbacks_set_send_callback(callbacks, &__h2pc_sess_send);
+    nghttp2_session_callbacks_set_recv_callback(callbacks, &__h2pc_sess_recv);
+    nghttp2_session_callbacks_set_on_frame_send_callback(callbacks, &__h2pc_sess_on_frame_send);
+    nghttp2_session_callbacks_set_on_frame_recv_callback(callbacks, &__h2pc_sess_on_frame_recv);
+    nghttp2_session_callbacks_set_on_stream_close_callback(callbacks, &__h2pc_sess_on_stream_close);
+    nghttp2_session_callbacks_set_on_data_chunk_recv_callback(callbacks, &__h2pc_sess_on_data_chunk);
+    nghttp2_session_callbacks_set_send_data_callback(callbacks, &h2pc_send_data_callback);
+
+    nghttp2_session * sess = NULL;
+    int ret = nghttp2_session_client_new(&sess, callbacks, &hd);
+    nghttp2_session_callbacks_del(callbacks);
+    if (ret != 0) return ESP_FAIL;
+    if (nghttp2_submit_settings(sess, NGHTTP2_FLAG_NONE, NULL, 0) != 0) {
+        nghttp2_session_del(sess);
+        return ESP_FAIL;
+    }
+    if (hd.http2_sess) nghttp2_session_del(hd.http2_sess);
+    hd.http2_sess = sess;
+    return ESP_OK;
+}
+#endif
 
-            if (flag) {
-                wcFramePool_push_back(inc_frame_pool, aFrame);
+/* waits until the socket is ready, h2pc_wakeup is called or timeout_ms expires.
+   returns false on the wait error */
+static bool __h2pc_wait_io(int timeout_ms) {
+    int sockfd = -1;
+    if ((!client_connected) || (hd.http2_tls == NULL) ||
+        (esp_tls_get_conn_sockfd(hd.http2_tls, &sockfd) != ESP_OK))
+        sockfd = -1;
+    if ((sockfd < 0) && (h2pc_wake_fd < 0)) {
+        vTaskDelay(1);
+        return true;
+    }
+    /* decrypted data is buffered inside tls - the socket may stay silent */
+    if ((sockfd >= 0) && (esp_tls_get_bytes_avail(hd.http2_tls) > 0)) return true;
+
+    fd_set rfds, wfds;
+    FD_ZERO(&rfds);
+    FD_ZERO(&wfds);
+    if (sockfd >= 0) {
+        FD_SET(sockfd, &rfds);
+        if (hd.http2_sess && nghttp2_session_want_write(hd.http2_sess))
+            FD_SET(sockfd, &wfds);
+    }
+    int maxfd = sockfd;
+    if (h2pc_wake_fd >= 0) {
+        FD_SET(h2pc_wake_fd, &rfds);
+        if (h2pc_wake_fd > maxfd) maxfd = h2pc_wake_fd;
+    }
 
-                ESP_LOGI(H2PC_TAG, "New frame pushed. size %d", aFrame->size);
-            } else {
-                wcFrame_free(aFrame);
-                ESP_LOGE(H2PC_TAG, "Frame is not pushed");
-            }
-        }
-        else
-            wcFrame_free(aFrame);
-        __inc_frames_unlock();
+    struct timeval tv;
+    tv.tv_sec = timeout_ms / 1000;
+    tv.tv_usec = (timeout_ms % 1000) * 1000;
+    int ret = select(maxfd + 1, &rfds, &wfds, NULL, &tv);
+    if (ret < 0) {
+        ESP_LOGE(H2PC_TAG, "Socket wait failed");
+        return false;
+    }
+    if ((ret > 0) && (h2pc_wake_fd >= 0) && FD_ISSET(h2pc_wake_fd, &rfds)) {
+        uint64_t v;
+        read(h2pc_wake_fd, &v, sizeof(v));
     }
+    return true;
 }
 
-int tryConsumeFrame(const void* Chunk, size_t ChunkSz)
-{
-    int32_t BP = 0;
-    int32_t P;
-    uint32_t C;
-    uint16_t W;
-    int ChunkPos = 0;
+void h2pc_prepare_to_send(cJSON * tosend) {
+    h2pc_req_ctx_prepare(req_def, tosend);
+}
 
-    bool proceed = true;
-    while (proceed)
-    {
-        if (bufferFreeSize() == 0)
-        {
-            ESP_LOGE(H2PC_TAG, "Frame buffer overflow");
-            proceed = false;
-            break;
-        }
+void h2pc_prepare_to_send_static(char * buf, int size) {
+    h2pc_req_ctx_prepare_static(req_def, buf, size);
+}
 
-        if (ChunkPos < ChunkSz)
-        {
-            frame_buffer->pos = frame_buffer_size;
-            P = ChunkSz - ChunkPos;
-            if (P > bufferFreeSize()) P = bufferFreeSize();
-            wcFrame_writeData(frame_buffer, ((char*)Chunk + ChunkPos), P);
-            ChunkPos += P;
-            frame_buffer_size = frame_buffer->pos;
-        }
+#ifdef CONFIG_WC_USE_IO_STREAMS
+/* wall clock time in ms. the peers compare the capture time with it */
+static uint32_t __h2pc_wall_ms() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint32_t)((uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000);
+}
+
+/* writes the frame header of the version. returns the header size */
+static int32_t __h2pc_frame_header(unsigned char * hdr, uint8_t ver, uint32_t size,
+                                   uint32_t seq, uint32_t stamp, uint16_t flags) {
+    uint16_t W = WEBCAM_FRAME_START_SEQ;
+    memcpy(hdr, &W, sizeof(uint16_t));
+    memcpy(&(hdr[2]), &size, sizeof(uint32_t));
+    if (ver < 2) return WEBCAM_FRAME_HEADER_SIZE;
+    uint16_t F = (flags & WC_FRAME_FLAG_KEYFRAME) ? WEBCAM_FRAME_FLAG_KEYFRAME : 0;
+    memcpy(&(hdr[6]), &seq, sizeof(uint32_t));
+    memcpy(&(hdr[10]), &stamp, sizeof(uint32_t));
+    memcpy(&(hdr[14]), &F, sizeof(uint16_t));
+    return WEBCAM_FRAME_HEADER_V2_SIZE;
+}
+
+void h2pc_os_prepare_frame(char * buf, int size) {
+    h2pc_os_prepare_frame_ext(buf, size, 0, 0);
+}
+
+void h2pc_os_prepare_frame_ext(char * buf, int size, uint32_t stamp, uint16_t flags) {
+    if (stamp == 0) stamp = __h2pc_wall_ms();
+    bytes_frame_hdr_len = __h2pc_frame_header(bytes_frame_hdr, out_hdr_ver, size, out_seq++, stamp, flags);
+    bytes_frame = buf;
+    bytes_frame_len = size + bytes_frame_hdr_len;
+    bytes_frame_pos = 0;
+    bytes_frame_pos_sended = 0;
+    sending_finished = false;
+    out_rc_frame_start = esp_timer_get_time();
+    h2pc_wakeup();
+}
+
+/* the session is locked */
+static void __h2pc_is_stats_frame() {
+    h2pc_is_stream_stats * st = &inc_stream_stats;
+    if (inc_hdr_ver < 2) {
+        st->frames++;
+        return;
+    }
+    if (st->frames > 0) {
+        int32_t d = (int32_t)(inc_hdr_seq - inc_seq_next);
+        if (d < 0) {
+            /* a late frame was counted as lost */
+            st->reordered++;
+            if (st->lost > 0) st->lost--;
+        } else {
+            st->lost += d;
+            inc_seq_next = inc_hdr_seq + 1;
+        }
+    } else
+        inc_seq_next = inc_hdr_seq + 1;
+    st->frames++;
+    st->last_seq = inc_hdr_seq;
+
+    int32_t lat = (int32_t)(__h2pc_wall_ms() - inc_hdr_stamp);
+    if (lat < 0) lat = 0; // the peer clocks are not in sync
+    st->latency_ms = lat;
+    st->avg_latency_ms = (st->frames == 1) ? lat : (st->avg_latency_ms * 7 + lat) / 8;
+    if (st->max_latency_ms < lat) st->max_latency_ms = lat;
+}
+
+void startFrame() {
+    int32_t hsz = inc_hdr_size;
+    int32_t frame_size = frame_body_size + hsz;
+
+    frame_body_left = frame_body_size;
+    inc_frame = NULL;
+    if (__inc_frames_lock()) {
+        /* exact sized frame - recycled by the pool allocator if it is set */
+        if (inc_frame_fanout)
+            inc_frame = wcFrameFanout_new_frame(inc_frame_fanout, frame_size);
+        else
+        if (inc_frame_pool)
+            inc_frame = wcFramePool_new_frame(inc_frame_pool, frame_size);
+        if ((inc_frame_fanout || inc_frame_pool) && (inc_frame == NULL))
+            ESP_LOGE(H2PC_TAG, "Frame allocation failed");
+        __inc_frames_unlock();
+    }
+    if (inc_frame) {
+        unsigned char hdr[WEBCAM_FRAME_HEADER_MAX_SIZE];
+        wcRing_peek(frame_buffer, 0, hdr, hsz);
+        wcFrame_writeData(inc_frame, hdr, hsz);
+        if (inc_hdr_ver >= 2) {
+            inc_frame->seq = inc_hdr_seq;
+            inc_frame->stamp = inc_hdr_stamp;
+            if (inc_hdr_flags & WEBCAM_FRAME_FLAG_KEYFRAME)
+                inc_frame->flags |= WC_FRAME_FLAG_KEYFRAME;
+        }
+    }
+}
+
+/* delivers the analysed frame. the frames mutex is locked */
+static void __inc_frame_deliver(wc_frame * aFrame, bool flag) {
+    if (inc_frame_fanout || inc_frame_pool) {
+        if (flag) {
+            ESP_LOGI(H2PC_TAG, "New frame pushed. size %d", aFrame->size);
+
+            /* one copy of the frame is shared by all the subscribers */
+            if (inc_frame_fanout)
+                wcFrameFanout_push(inc_frame_fanout, aFrame);
+            else
+                wcFramePool_push_back(inc_frame_pool, aFrame);
+        } else {
+            wcFrame_free(aFrame);
+            ESP_LOGE(H2PC_TAG, "Frame is not pushed");
+        }
+    }
+    else
+        wcFrame_free(aFrame);
+}
+
+static void __inc_analyser_stats_add(int64_t dt) {
+    inc_analyser_stats.frames++;
+    inc_analyser_stats.last_us = (uint32_t) dt;
+    if (inc_analyser_stats.max_us < (uint32_t) dt)
+        inc_analyser_stats.max_us = (uint32_t) dt;
+    inc_analyser_stats.total_us += dt;
+}
+
+void pushFrame() {
+    wc_frame * aFrame = inc_frame;
+    inc_frame = NULL;
+    if (aFrame == NULL) return;
+
+    aFrame->pos = 0;
+    if (__inc_frames_lock()) {
+        if (inc_analyser_queue) {
+            /* the analyser task takes the frame - the receive path is not stalled */
+            if (xQueueSend(inc_analyser_queue, &aFrame, 0) == pdTRUE) {
+                uint32_t depth = uxQueueMessagesWaiting(inc_analyser_queue);
+                if (inc_analyser_stats.queue_max_depth < depth)
+                    inc_analyser_stats.queue_max_depth = depth;
+            } else {
+                inc_analyser_stats.dropped++;
+                wcFrame_free(aFrame);
+                ESP_LOGW(H2PC_TAG, "Analyser queue is full. Frame dropped");
+            }
+        } else {
+            bool flag = true;
+            if ((inc_frame_fanout || inc_frame_pool) && inc_frame_analyser) {
+                int64_t t0 = esp_timer_get_time();
+                flag = inc_frame_analyser(inc_frame_analyser_data, aFrame, inc_hdr_size);
+                __inc_analyser_stats_add(esp_timer_get_time() - t0);
+            }
+            __inc_frame_deliver(aFrame, flag);
+        }
+        __inc_frames_unlock();
+    } else
+        wcFrame_free(aFrame);
+}
+
+static void __inc_analyser_task(void * arg) {
+    QueueHandle_t queue = (QueueHandle_t) arg;
+    wc_frame * aFrame;
+
+    while (xQueueReceive(queue, &aFrame, portMAX_DELAY) == pdTRUE) {
+        if (aFrame == NULL) break; // stop request
+
+        h2pc_cb_inc_frame_analyse analyser = NULL;
+        void * analyser_data = NULL;
+        if (__inc_frames_lock()) {
+            analyser = inc_frame_analyser;
+            analyser_data = inc_frame_analyser_data;
+            __inc_frames_unlock();
+        }
+
+        /* the analyser runs unlocked - new frames are allocated meanwhile */
+        bool flag = true;
+        int64_t dt = 0;
+        if (analyser) {
+            int64_t t0 = esp_timer_get_time();
+            flag = analyser(analyser_data, aFrame, inc_hdr_size);
+            dt = esp_timer_get_time() - t0;
+        }
+
+        if (__inc_frames_lock()) {
+            if (analyser) __inc_analyser_stats_add(dt);
+            __inc_frame_deliver(aFrame, flag);
+            __inc_frames_unlock();
+        } else
+            wcFrame_free(aFrame);
+    }
+
+    xSemaphoreGive(inc_analyser_done);
+    vTaskDelete(NULL);
+}
+
+#define H2PC_START_SEQ_LO ((uint8_t)(WEBCAM_FRAME_START_SEQ & 0xff))
+#define H2PC_START_SEQ_HI ((uint8_t)(WEBCAM_FRAME_START_SEQ >> 8))
+
+/* returns the position of the first frame start marker in buf or -1.
+ * a word at a time is tested for the first marker byte before the bytes are checked */
+static int32_t __h2pc_scan_start_seq(const uint8_t * buf, int32_t len) {
+    const uint32_t ones = 0x01010101u;
+    const uint32_t pattern = H2PC_START_SEQ_LO * ones;
+    int32_t i = 0;
+
+    while ((i < len) && (((uintptr_t)(buf + i)) & 0x3)) {
+        if ((buf[i] == H2PC_START_SEQ_LO) && ((i + 1) < len) && (buf[i + 1] == H2PC_START_SEQ_HI))
+            return i;
+        i++;
+    }
+    while ((i + 4) <= len) {
+        uint32_t x = *((const uint32_t *)(buf + i)) ^ pattern;
+        /* has a zero byte - the word contains the first marker byte */
+        if (((x - ones) & ~x & (ones << 7)) != 0) {
+            for (int k = 0; k < 4; k++) {
+                if ((buf[i + k] == H2PC_START_SEQ_LO) && ((i + k + 1) < len) &&
+                    (buf[i + k + 1] == H2PC_START_SEQ_HI))
+                    return i + k;
+            }
+        }
+        i += 4;
+    }
+    while (i < len) {
+        if ((buf[i] == H2PC_START_SEQ_LO) && ((i + 1) < len) && (buf[i + 1] == H2PC_START_SEQ_HI))
+            return i;
+        i++;
+    }
+    return -1;
+}
+
+/* skips the bytes up to the next frame start marker. true if the marker is found */
+bool resyncFrameBuffer(const uint8_t * Chunk, size_t ChunkSz, int * ChunkPos) {
+    /* the rest of the buffered header first */
+    while (wcRing_size(frame_buffer) > 0) {
+        uint8_t b = 0;
+        wcRing_peek(frame_buffer, 0, &b, 1);
+        if (b == H2PC_START_SEQ_LO) {
+            uint8_t n;
+            if (wcRing_size(frame_buffer) > 1)
+                wcRing_peek(frame_buffer, 1, &n, 1);
+            else
+            if (*ChunkPos < ChunkSz)
+                n = Chunk[*ChunkPos];
+            else
+                return false; // half of the marker - wait for the next chunk
+            if (n == H2PC_START_SEQ_HI) return true;
+        }
+        wcRing_skip(frame_buffer, 1);
+        inc_bytes_skipped++;
+    }
+
+    int32_t left = ChunkSz - *ChunkPos;
+    int32_t i = __h2pc_scan_start_seq(Chunk + *ChunkPos, left);
+    if (i >= 0) {
+        inc_bytes_skipped += i;
+        *ChunkPos += i;
+        return true;
+    }
+    /* keep a trailing half of the marker */
+    int32_t skip = left;
+    if ((left > 0) && (Chunk[ChunkSz - 1] == H2PC_START_SEQ_LO)) skip--;
+    inc_bytes_skipped += skip;
+    *ChunkPos += skip;
+    if (skip < left) {
+        wcRing_write(frame_buffer, Chunk + *ChunkPos, 1);
+        (*ChunkPos)++;
+    }
+    return false;
+}
+
+int tryConsumeFrame(const void* Chunk, size_t ChunkSz)
+{
+    int32_t P;
+    uint32_t C;
+    uint16_t W;
+    int ChunkPos = 0;
+    int32_t hsz = inc_hdr_size;
+
+    bool proceed = true;
+    while (proceed)
+    {
+        switch (frame_state) {
+            case H2PC_FST_WAITING_START_OF_FRAME:
+            {
+                /* only the header is buffered - the body goes straight to its frame */
+                P = hsz - wcRing_size(frame_buffer);
+                if (P > (int32_t)(ChunkSz - ChunkPos)) P = ChunkSz - ChunkPos;
+                if (P > 0)
+                    ChunkPos += wcRing_write(frame_buffer, ((const char*)Chunk + ChunkPos), P);
 
-        frame_buffer->pos = BP;
-        switch (frame_state) {
-            case H2PC_FST_WAITING_START_OF_FRAME:
-            {
                 frame_body_size = 0;
-                if (((int32_t)frame_buffer_size - BP) >= (int32_t)WEBCAM_FRAME_HEADER_SIZE)
+                if (wcRing_size(frame_buffer) >= hsz)
                 {
-                    W = wcFrame_readWord(frame_buffer);
+                    bool valid = false;
+                    W = wcRing_peekWord(frame_buffer, 0);
                     if (W == WEBCAM_FRAME_START_SEQ)
                     {
-                        C = wcFrame_readUInt32(frame_buffer);
-                        if (C > (H2PC_MAX_ALLOWED_FRAMES_SIZE - WEBCAM_FRAME_HEADER_SIZE))
+                        C = wcRing_peekUInt32(frame_buffer, sizeof(uint16_t));
+                        if (C > (H2PC_MAX_ALLOWED_FRAMES_SIZE - hsz))
                         {
                             ESP_LOGE(H2PC_TAG, "Frame size is too big");
-                            proceed = false;
                         } else {
+                            valid = true;
                             frame_body_size = C;
+                            if (inc_hdr_ver >= 2) {
+                                inc_hdr_seq = wcRing_peekUInt32(frame_buffer, 6);
+                                inc_hdr_stamp = wcRing_peekUInt32(frame_buffer, 10);
+                                inc_hdr_flags = wcRing_peekWord(frame_buffer, 14);
+                            }
+                            __h2pc_is_stats_frame();
+                            startFrame();
+                            wcRing_skip(frame_buffer, hsz);
                             frame_state = H2PC_FST_WAITING_DATA;
                         }
                     } else {
                         ESP_LOGE(H2PC_TAG, "Frame wrong header");
-                        proceed = false;
+                    }
+                    if (!valid) {
+                        if (inc_resync) {
+                            /* the marker is not at the first byte */
+                            inc_resyncs_cnt++;
+                            wcRing_skip(frame_buffer, 1);
+                            inc_bytes_skipped++;
+                            frame_state = H2PC_FST_RESYNC;
+                        } else
+                            proceed = false;
                     }
                 } else
-                {
-                    truncateFrameBuffer(&BP);
-                    if (ChunkPos == ChunkSz) proceed = false;
-                }
+                    proceed = false;
                 break;
             }
             case H2PC_FST_WAITING_DATA:
             {
-                if (((int32_t)frame_buffer_size - BP) >= (int32_t)(frame_body_size + WEBCAM_FRAME_HEADER_SIZE))
+                P = frame_body_left;
+                if (P > (int32_t)(ChunkSz - ChunkPos)) P = ChunkSz - ChunkPos;
+                if (P > 0) {
+                    if (inc_frame)
+                        wcFrame_writeData(inc_frame, ((const char*)Chunk + ChunkPos), P);
+                    ChunkPos += P;
+                    frame_body_left -= P;
+                }
+                if (frame_body_left == 0)
                 {
-                    pushFrame(BP);
-                    BP += frame_body_size + WEBCAM_FRAME_HEADER_SIZE;
+                    pushFrame();
                     frame_state = H2PC_FST_WAITING_START_OF_FRAME;
                 } else
-                {
-                    truncateFrameBuffer(&BP);
-                    if (ChunkPos == ChunkSz) proceed = false;
-                }
+                    proceed = false;
+                break;
+            }
+            case H2PC_FST_RESYNC:
+            {
+                if (resyncFrameBuffer((const uint8_t *)Chunk, ChunkSz, &ChunkPos)) {
+                    ESP_LOGW(H2PC_TAG, "Frame header found. Skipped bytes total %d", inc_bytes_skipped);
+                    frame_state = H2PC_FST_WAITING_START_OF_FRAME;
+                } else
+                    proceed = false;
                 break;
             }
         }
@@ -830,11 +2078,92 @@ int tryConsumeFrame(const void* Chunk, size_t ChunkSz)
     return ChunkPos;
 }
 
+/* the initial window of the incoming stream */
+static int32_t __h2pc_wt_initial() {
+    int32_t w = (sess_settings.initial_window_size > 0) ? sess_settings.initial_window_size :
+                                                          NGHTTP2_INITIAL_WINDOW_SIZE;
+    if (w < inc_wt_min) w = inc_wt_min;
+    if (w > inc_wt_max) w = inc_wt_max;
+    return w;
+}
+
+/* the session is locked */
+static void __h2pc_wt_apply(int32_t window) {
+    if (nghttp2_session_set_local_window_size(hd.http2_sess, NGHTTP2_FLAG_NONE,
+                                              inc_streaming_strm_id, window) != 0) {
+        ESP_LOGE(H2PC_TAG, "Failed to set the stream window");
+        return;
+    }
+    /* the room for the json responses is kept on the connection */
+    int32_t conn = window + NGHTTP2_INITIAL_CONNECTION_WINDOW_SIZE;
+    if (conn < sess_settings.connection_window_size) conn = sess_settings.connection_window_size;
+    nghttp2_session_set_local_window_size(hd.http2_sess, NGHTTP2_FLAG_NONE, 0, conn);
+    inc_wt.window = window;
+}
+
+/* once per H2PC_WT_INTERVAL_MS. the window is doubled while the throughput
+   grows and the pool has room. the full pool halves the window. the session is locked */
+static void __h2pc_wt_update() {
+    if ((!inc_wt_enabled) || (inc_streaming_strm_id <= 0) || (hd.http2_sess == NULL)) return;
+    int64_t now = esp_timer_get_time();
+    int64_t dt = now - inc_wt_last;
+    if (dt < (int64_t)H2PC_WT_INTERVAL_MS * 1000) return;
+    inc_wt_last = now;
+
+    uint32_t rate = (uint32_t)(((int64_t)inc_wt_bytes * 1000000) / dt);
+    inc_wt_bytes = 0;
+    inc_wt.throughput = rate;
+    uint8_t fill = 0;
+    if (__inc_frames_lock()) {
+        fill = inc_frame_fanout ? wcFrameFanout_fill(inc_frame_fanout) : wcFramePool_fill(inc_frame_pool);
+        __inc_frames_unlock();
+    }
+    inc_wt.fill = fill;
+
+    int32_t window = inc_wt.window;
+    if (fill >= H2PC_WT_HIGH_FILL) {
+        window /= 2;
+        inc_wt.shrinks++;
+        inc_wt.plateau = false;
+        inc_wt.best_throughput = 0;
+        inc_wt_stalls = 0;
+    } else
+    if (inc_wt.plateau) {
+        /* the link has changed - probe again */
+        if (rate < inc_wt.best_throughput / 2) {
+            inc_wt.plateau = false;
+            inc_wt.best_throughput = rate;
+            inc_wt_stalls = 0;
+        }
+    } else
+    if ((fill < H2PC_WT_LOW_FILL) && (rate > 0)) {
+        if (rate > inc_wt.best_throughput + inc_wt.best_throughput / 10) {
+            inc_wt.best_throughput = rate;
+            inc_wt_stalls = 0;
+        } else
+            inc_wt_stalls++;
+        if (inc_wt_stalls >= 2) {
+            /* the last growth gave nothing - step it back */
+            inc_wt.plateau = true;
+            window /= 2;
+        } else {
+            window *= 2;
+            inc_wt.grows++;
+        }
+    }
+    if (window < inc_wt_min) window = inc_wt_min;
+    if (window > inc_wt_max) window = inc_wt_max;
+    if (window != inc_wt.window)
+        __h2pc_wt_apply(window);
+}
+
 int handle_frame_response(struct sh2lib_handle *handle, int32_t stream_id, const char *data, size_t len, int flags)
 {
     if (len) {
         ESP_LOGI(H2PC_TAG, "[get-frame-response] Data frame received. Size %d", len);
         tryConsumeFrame((const void *)data, len);
+        inc_wt_bytes += len;
+        __h2pc_wt_update();
     }
     if (flags == DATA_RECV_FRAME_COMPLETE) {
         ESP_LOGI(H2PC_TAG, "[get-frame-response] Frame fully received");
@@ -845,140 +2174,926 @@ int handle_frame_response(struct sh2lib_handle *handle, int32_t stream_id, const
             inc_streaming_strm_id = -1;
      } else
     if ( flags == DATA_RECV_GOAWAY ) {
-        h2pc_disconnect_http2();
+        /* the session can not be freed inside its callbacks */
+        sess_lost = true;
     }
     return 0;
 }
 
 #endif
 
+static h2pc_req_ctx * __h2pc_req_find(int32_t stream_id) {
+    h2pc_req_ctx * ctx = req_ctxs;
+    while (ctx) {
+        if (ctx->strm_id == stream_id) return ctx;
+        ctx = ctx->next;
+    }
+    return NULL;
+}
+
+/* the session is locked */
+static void __h2pc_req_unlink(h2pc_req_ctx * ctx) {
+    h2pc_req_ctx ** p = &req_ctxs;
+    while (*p) {
+        if (*p == ctx) {
+            *p = ctx->next;
+            break;
+        }
+        p = &((*p)->next);
+    }
+    ctx->next = NULL;
+}
+
+/* the session is locked */
+static void __h2pc_req_complete(h2pc_req_ctx * ctx) {
+    __h2pc_req_unlink(ctx);
+    ctx->strm_id = -1;
+    ctx->finished = true;
+    if (ctx->on_done) {
+        /* completed by the network task in the order of arrival */
+        h2pc_req_ctx ** p = &req_done;
+        while (*p) p = &((*p)->next);
+        *p = ctx;
+    } else
+    if (ctx->waiter)
+        xSemaphoreGive(ctx->waiter);
+    /* the owner may wait for the socket while another task serves the session */
+    h2pc_wakeup();
+}
+
+static void __h2pc_req_ctx_free_tosend(h2pc_req_ctx * ctx) {
+    if (ctx->need_to_free && ctx->tosend)
+        free(ctx->tosend);
+    if (ctx->need_to_free && ctx->tosend_json)
+        cJSON_Delete((cJSON *) ctx->tosend_json);
+    ctx->tosend = NULL;
+    ctx->tosend_json = NULL;
+    ctx->need_to_free = false;
+    ctx->tosend_len = 0;
+    ctx->tosend_pos = 0;
+}
+
+h2pc_req_ctx * h2pc_req_ctx_new() {
+    h2pc_req_ctx * ctx = malloc(sizeof(h2pc_req_ctx));
+    if (ctx == NULL) return NULL;
+    memset(ctx, 0, sizeof(h2pc_req_ctx));
+    ctx->strm_id = -1;
+    ctx->resp_size = H2PC_INITIAL_RESP_BUFFER;
+    ctx->resp = malloc(ctx->resp_size);
+    if (ctx->resp == NULL) {
+        free(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+void h2pc_req_ctx_free(h2pc_req_ctx * ctx) {
+    /* the list is changed by the network task - check it under the lock */
+    if (h2pc_sess_mux && __h2pc_sess_lock()) {
+        if (ctx->next || (ctx == req_ctxs))
+            __h2pc_req_unlink(ctx);
+        __h2pc_sess_unlock();
+    }
+    __h2pc_req_ctx_free_tosend(ctx);
+    if (ctx->splitter) wcJsonSplitter_free(ctx->splitter);
+    if (ctx->resp) free(ctx->resp);
+    if (ctx->path_need_to_free) free((void *) ctx->path);
+    if (ctx->waiter) vSemaphoreDelete(ctx->waiter);
+    free(ctx);
+}
+
+void h2pc_req_ctx_prepare(h2pc_req_ctx * ctx, cJSON * tosend) {
+    __h2pc_req_ctx_free_tosend(ctx);
+    ctx->tosend = cJSON_PrintUnformatted(tosend);
+    ctx->tosend_len = ctx->tosend ? strlen(ctx->tosend) : 0;
+    ctx->need_to_free = true;
+    ctx->resp_len = 0;
+    ctx->finished = false;
+}
+
+/* the tree is written by parts while the request is sent. the content length is
+ * measured here, so the tree must not be changed until the request is finished.
+ * the trees deeper than WC_JSON_MAX_DEPTH are printed at once */
+int h2pc_req_ctx_prepare_json(h2pc_req_ctx * ctx, cJSON * tosend, bool is_own) {
+    __h2pc_req_ctx_free_tosend(ctx);
+    ctx->resp_len = 0;
+    ctx->finished = false;
+    int len = wcJson_measure(tosend);
+    if (len < 0) {
+        /* the tree is nested deeper than the writer can follow - send it printed */
+        ESP_LOGW(H2PC_TAG, "json is too deep to be written by parts");
+        char * txt = cJSON_PrintUnformatted(tosend);
+        if (is_own) cJSON_Delete(tosend);
+        if (txt == NULL) return H2PC_ERR_INTERNAL;
+        ctx->tosend = txt;
+        ctx->tosend_len = strlen(txt);
+        ctx->need_to_free = true;
+        return ESP_OK;
+    }
+    ctx->tosend_json = tosend;
+    ctx->tosend_len = len;
+    ctx->need_to_free = is_own;
+    wcJsonWriter_init(&(ctx->writer), tosend);
+    return ESP_OK;
+}
+
+void h2pc_req_ctx_prepare_static(h2pc_req_ctx * ctx, char * buf, int size) {
+    __h2pc_req_ctx_free_tosend(ctx);
+    ctx->tosend = buf;
+    ctx->tosend_len = size;
+    ctx->resp_len = 0;
+    ctx->finished = false;
+}
+
+static bool __h2pc_req_ctx_append(h2pc_req_ctx * ctx, const char * data, size_t len) {
+    int new_resp_buffer_size = ctx->resp_len + len;
+    if (new_resp_buffer_size >= ctx->resp_size) {
+        if (new_resp_buffer_size < H2PC_MAXIMUM_RESP_BUFFER) {
+            new_resp_buffer_size = (new_resp_buffer_size / 1024 + 1) * 1024;
+            if (new_resp_buffer_size > H2PC_MAXIMUM_RESP_BUFFER) {
+                new_resp_buffer_size = H2PC_MAXIMUM_RESP_BUFFER;
+            }
+            ctx->resp = realloc(ctx->resp, new_resp_buffer_size);
+            ctx->resp_size = new_resp_buffer_size;
+        } else {
+            ESP_LOGI(H2PC_TAG, "[get-response] response buffer overflow");
+            return false;
+        }
+    }
+    memcpy(&(ctx->resp[ctx->resp_len]), data, len);
+    ctx->resp_len += len;
+    return true;
+}
+
 int handle_get_response(struct sh2lib_handle *handle, int32_t stream_id, const char *data, size_t len, int flags)
 {
+    h2pc_req_ctx * ctx = __h2pc_req_find(stream_id);
+    if (ctx == NULL) {
+        ESP_LOGW(H2PC_TAG, "[get-response] Unknown stream %d", stream_id);
+        return 0;
+    }
     if (len) {
         ESP_LOGI(H2PC_TAG, "[get-response] %.*s", len, data);
-        int new_resp_buffer_size = resp_len + len;
-        if (new_resp_buffer_size >= resp_buffer_size) {
-            if (new_resp_buffer_size < H2PC_MAXIMUM_RESP_BUFFER) {
-                new_resp_buffer_size = (new_resp_buffer_size / 1024 + 1) * 1024;
-                if (new_resp_buffer_size > H2PC_MAXIMUM_RESP_BUFFER) {
-                    new_resp_buffer_size = H2PC_MAXIMUM_RESP_BUFFER;
-                }
-                resp_buffer = realloc(resp_buffer, new_resp_buffer_size);
-                resp_buffer_size = new_resp_buffer_size;
-            } else {
-                ESP_LOGI(H2PC_TAG, "[get-response] response buffer overflow");
-                return 0;
-            }
-        }
-        memcpy(&(resp_buffer[resp_len]), data, len);
-        resp_len += len;
+        if (ctx->splitter)
+            wcJsonSplitter_feed(ctx->splitter, data, len);
+        else
+            __h2pc_req_ctx_append(ctx, data, len);
     }
     if (flags == DATA_RECV_FRAME_COMPLETE) {
         ESP_LOGI(H2PC_TAG, "[get-response] Frame fully received");
     } else
     if ( flags == DATA_RECV_RST_STREAM ) {
         ESP_LOGI(H2PC_TAG, "[get-response] Stream Closed");
-        if (resp_len == resp_buffer_size) {
+        if (ctx->resp_len == ctx->resp_size) {
             /* not often but may be */
-            resp_buffer = realloc(resp_buffer, resp_buffer_size + 1);
+            ctx->resp = realloc(ctx->resp, ctx->resp_size + 1);
+            ctx->resp_size++;
         }
-        resp_buffer[resp_len] = 0; // terminate string
-        request_finished = true;
+        ctx->resp[ctx->resp_len] = 0; // terminate string
+        __h2pc_req_complete(ctx);
     } else
     if ( flags == DATA_RECV_GOAWAY ) {
-        h2pc_disconnect_http2();
+        /* the session can not be freed inside its callbacks */
+        sess_lost = true;
     }
     return 0;
 }
 
 int send_post_data(struct sh2lib_handle *handle, int32_t stream_id, char *buf, size_t length, uint32_t *data_flags)
 {
-    int cur_bytes_tosend_len = bytes_tosend_len - bytes_tosend_pos;
+    h2pc_req_ctx * ctx = __h2pc_req_find(stream_id);
+    if (ctx == NULL) {
+        (*data_flags) |= NGHTTP2_DATA_FLAG_EOF;
+        return 0;
+    }
+
+    int cur_bytes_tosend_len = ctx->tosend_len - ctx->tosend_pos;
     if (cur_bytes_tosend_len < length) length = cur_bytes_tosend_len;
 
+    if (ctx->tosend_json) {
+        /* the tree is serialized straight into the frame */
+        int len = (length > 0) ? wcJsonWriter_write(&(ctx->writer), buf, length) : 0;
+        if (len != (int) length) {
+            ESP_LOGE(H2PC_TAG, "[data-prvd] Serialization failed");
+            return NGHTTP2_ERR_CALLBACK_FAILURE;
+        }
+        ESP_LOGI(H2PC_TAG, "[data-prvd] Sending %d bytes", length);
+        ctx->tosend_pos += length;
+        if (ctx->tosend_len == ctx->tosend_pos) {
+            (*data_flags) |= NGHTTP2_DATA_FLAG_EOF;
+        }
+        return length;
+    }
+
+#ifdef CONFIG_H2PC_DATA_NO_COPY
+    /* the content is written by h2pc_send_data_callback, it moves tosend_pos */
+    (*data_flags) |= NGHTTP2_DATA_FLAG_NO_COPY;
+    if (ctx->tosend_pos + length == ctx->tosend_len) {
+        (*data_flags) |= NGHTTP2_DATA_FLAG_EOF;
+    }
+#else
     if (length > 0) {
         /* dst - buf,
-         * src - bytes_tosend at bytes_tosend_pos */
-        memcpy(buf, &(bytes_tosend[bytes_tosend_pos]), length);
+         * src - tosend at tosend_pos */
+        memcpy(buf, &(ctx->tosend[ctx->tosend_pos]), length);
         ESP_LOGI(H2PC_TAG, "[data-prvd] Sending %d bytes", length);
-        bytes_tosend_pos += length;
+        ctx->tosend_pos += length;
     }
 
-    if (bytes_tosend_len == bytes_tosend_pos) {
+    if (ctx->tosend_len == ctx->tosend_pos) {
         (*data_flags) |= NGHTTP2_DATA_FLAG_EOF;
     }
+#endif
 
     return length;
 }
 
-void h2pc_do_post(char * aPath) {
-    sh2lib_do_post(&hd, aPath, bytes_tosend_len, send_post_data, handle_get_response);
+int h2pc_req_ctx_post(h2pc_req_ctx * ctx, const char * aPath) {
+    if (!h2pc_get_connected()) return H2PC_ERR_NOT_CONNECTED;
+
+    int ret = ESP_OK;
+    if (net_running && (ctx->on_done == NULL)) {
+        /* the network task serves the session - the owner just waits */
+        if (ctx->waiter == NULL)
+            ctx->waiter = xSemaphoreCreateBinary();
+        else
+            xSemaphoreTake(ctx->waiter, 0);
+    }
+    if (__h2pc_sess_lock()) {
+        ctx->resp_len = 0;
+        ctx->finished = false;
+        /* the data is sent by the session later - the stream is known by then */
+        ctx->strm_id = sh2lib_do_post(&hd, aPath, ctx->tosend_len, send_post_data, handle_get_response);
+        __h2pc_stream_set_weight(ctx->strm_id, sess_settings.msgs_weight);
+        if (ctx->strm_id > 0) {
+            ctx->next = req_ctxs;
+            req_ctxs = ctx;
+        } else {
+            ctx->finished = true;
+            ret = H2PC_ERR_INTERNAL;
+        }
+        __h2pc_sess_unlock();
+    }
+    h2pc_wakeup();
+    return ret;
 }
 
-bool h2pc_wait_for_response() {
+bool h2pc_req_ctx_wait(h2pc_req_ctx * ctx) {
     bool res = true;
-    resp_len = 0;
-    while (1) {
-        /* Process HTTP2 send/receive */
-        if (sh2lib_execute(&hd) < 0) {
-            ESP_LOGE(H2PC_TAG, "Error in send/receive");
-            h2pc_disconnect_http2();
-            res = false;
-            break;
+    if (ctx->waiter && net_running && !ctx->finished) {
+        while (xSemaphoreTake(ctx->waiter, pdMS_TO_TICKS(H2PC_IO_WAIT_MS)) != pdTRUE) {
+            /* the network task is stopped - serve the session here */
+            if (!net_running) break;
+        }
+    }
+    while (!ctx->finished && h2pc_get_connected()) {
+        /* Process HTTP2 send/receive. all the streams are served */
+        if (__h2pc_sess_lock()) {
+            int ret = client_connected ? sh2lib_execute(&hd) : 0;
+            __h2pc_sess_unlock();
+            if ((ret < 0) || sess_lost) {
+                ESP_LOGE(H2PC_TAG, "Error in send/receive");
+                __h2pc_conn_lost();
+                res = false;
+                break;
+            }
         }
-        if (request_finished || !h2pc_get_connected())
+        /* the messages received by the exchange */
+        __h2pc_im_dispatch_pool();
+        if (ctx->finished || !h2pc_get_connected())
             break;
 
-        vTaskDelay(2);
+        __h2pc_wait_io(H2PC_IO_WAIT_MS);
     }
-    if (bytes_need_to_free) {
-        free(bytes_tosend);
-        //
-        bytes_need_to_free = false;
+    if (ctx->waiter && __h2pc_sess_lock()) {
+        /* the completion in another task is over */
+        __h2pc_sess_unlock();
     }
-    bytes_tosend = NULL;
-    bytes_tosend_len = 0;
-    bytes_tosend_pos = 0;
+    __h2pc_req_ctx_free_tosend(ctx);
     return res;
 }
 
+/* calls the finish functions and completion callbacks of the finished async requests */
+static void __h2pc_net_dispatch() {
+    h2pc_req_ctx * done = NULL;
+    if (__h2pc_sess_lock()) {
+        done = req_done;
+        req_done = NULL;
+        __h2pc_sess_unlock();
+    }
+    while (done) {
+        h2pc_req_ctx * ctx = done;
+        done = ctx->next;
+        ctx->next = NULL;
+        __h2pc_req_ctx_free_tosend(ctx);
+        int res = ctx->finish ? ctx->finish(ctx) : ESP_OK;
+        if (ctx->on_done) ctx->on_done(res, ctx->user_data);
+        h2pc_req_ctx_free(ctx);
+    }
+    /* the messages received by the last exchange */
+    __h2pc_im_dispatch_pool();
+}
+
+static void __h2pc_om_batch_done(int res, void * user_data) {
+    /* the batch counts when the server took it */
+    if ((res == ESP_OK) && om_batch_reason && h2pc_om_lock()) {
+        static const uint32_t bounds[H2PC_OM_AGE_BUCKETS - 1] = {10, 50, 100, 500, 1000};
+        int b = 0;
+        while ((b < H2PC_OM_AGE_BUCKETS - 1) && (om_batch_age >= bounds[b])) b++;
+        om_batch_stats.age_hist[b]++;
+        om_batch_stats.flushes++;
+        (*om_batch_reason)++;
+        h2pc_om_unlock();
+    }
+    om_batch_reason = NULL;
+    om_batch_in_flight = false;
+}
+
+/* sends the pool when one of the batching limits is reached. one batch is in flight */
+static void __h2pc_om_batch_check() {
+    if (!om_batching || om_batch_in_flight || !h2pc_sid || !client_connected) return;
+
+    uint32_t * reason = NULL;
+    if (h2pc_om_lock()) {
+        if (om_dirty) __h2pc_om_recount();
+        if (om_cnt > 0) {
+            uint32_t age = (uint32_t)((esp_timer_get_time() - om_first_at) / 1000);
+            if (om_batch_cfg.max_msgs && (om_cnt >= om_batch_cfg.max_msgs))
+                reason = &(om_batch_stats.by_msgs);
+            else
+            if (om_batch_cfg.max_bytes && (om_bytes >= om_batch_cfg.max_bytes))
+                reason = &(om_batch_stats.by_bytes);
+            else
+            if (om_batch_cfg.max_age_ms && (age >= om_batch_cfg.max_age_ms))
+                reason = &(om_batch_stats.by_age);
+            om_batch_age = age;
+        }
+        h2pc_om_unlock();
+    }
+    if (reason == NULL) return;
+
+    om_batch_in_flight = true;
+    om_batch_reason = reason;
+    if (h2pc_req_send_msgs_async(&__h2pc_om_batch_done, NULL) != ESP_OK) {
+        om_batch_reason = NULL;
+        om_batch_in_flight = false;
+    }
+}
+
+static void __h2pc_net_task(void * arg) {
+    while (!net_stop) {
+        if (client_connected) {
+            int ret = 0;
+            if (__h2pc_sess_lock()) {
+#ifdef CONFIG_WC_USE_IO_STREAMS
+                /* the outgoing stream is deferred while its queue is empty */
+                if (client_connected && (out_streaming_strm_id > 0) && out_frame_pool &&
+                    (out_frame || wcFramePool_frames_cnt(out_frame_pool)))
+                    nghttp2_session_resume_data(hd.http2_sess, out_streaming_strm_id);
+#endif
+                /* Process HTTP2 send/receive. all the streams are served */
+                if (client_connected) ret = sh2lib_execute(&hd);
+#ifdef CONFIG_WC_USE_IO_STREAMS
+                __h2pc_rc_update();
+                __h2pc_wt_update();
+#endif
+                __h2pc_sess_unlock();
+            }
+            if ((ret < 0) || sess_lost) {
+                ESP_LOGE(H2PC_TAG, "Error in send/receive");
+                __h2pc_conn_lost();
+            }
+        }
+        __h2pc_net_dispatch();
+        __h2pc_om_batch_check();
+        if (!net_stop)
+            __h2pc_wait_io(H2PC_IO_WAIT_MS);
+    }
+
+    xSemaphoreGive(net_done);
+    vTaskDelete(NULL);
+}
+
+int h2pc_net_start(UBaseType_t priority, BaseType_t core_id) {
+    if (net_running) return ESP_ERR_INVALID_STATE;
+    if (h2pc_sess_mux == NULL) return ESP_ERR_INVALID_STATE;
+    if (net_done == NULL) {
+        net_done = xSemaphoreCreateBinary();
+        if (net_done == NULL) return ESP_ERR_NO_MEM;
+    }
+
+    net_stop = false;
+    net_running = true;
+    if (xTaskCreatePinnedToCore(&__h2pc_net_task, "h2pc_net", H2PC_NET_STACK_SIZE,
+                                NULL, priority, NULL, core_id) != pdPASS) {
+        net_running = false;
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+void h2pc_net_stop() {
+    if (!net_running) return;
+    net_running = false;
+    net_stop = true;
+    h2pc_wakeup();
+    xSemaphoreTake(net_done, portMAX_DELAY);
+
+    /* nobody serves the async requests in flight now */
+    if (__h2pc_sess_lock()) {
+        h2pc_req_ctx * ctx = req_ctxs;
+        while (ctx) {
+            h2pc_req_ctx * next = ctx->next;
+            if (ctx->on_done) {
+                if (client_connected && hd.http2_sess)
+                    nghttp2_submit_rst_stream(hd.http2_sess, NGHTTP2_FLAG_NONE, ctx->strm_id, NGHTTP2_CANCEL);
+                ctx->resp_len = 0;
+                __h2pc_req_complete(ctx);
+            }
+            ctx = next;
+        }
+        __h2pc_sess_unlock();
+    }
+    __h2pc_net_dispatch();
+}
+
+bool h2pc_net_is_running() {
+    return net_running;
+}
+
+static void __h2pc_cm_notify(int state) {
+    if (cm_cb) cm_cb(cm_data, state);
+}
+
+/* full backoff up to the cap, then a random point in its upper half */
+static uint32_t __h2pc_cm_backoff(uint32_t attempt) {
+    uint32_t delay = cm_cfg.max_backoff_ms;
+    if (attempt < 16) {
+        uint64_t d = (uint64_t)cm_cfg.min_backoff_ms << attempt;
+        if (d < delay) delay = (uint32_t) d;
+    }
+    return delay / 2 + esp_random() % (delay / 2 + 1);
+}
+
+/* connects, authorizes and reopens the streams */
+static int __h2pc_cm_reconnect() {
+    if (cm_server == NULL) return ESP_ERR_INVALID_STATE;
+    if (!h2pc_connect_to_http2_ext(cm_server, NULL))
+        return H2PC_ERR_NOT_CONNECTED;
+
+    int ret = ESP_OK;
+    if (cm_name) {
+        cJSON * meta = cm_meta ? cJSON_Duplicate(cm_meta, true) : NULL;
+        ret = h2pc_req_authorize_sync(cm_name, cm_pwrd, cm_dev, meta, meta != NULL);
+        if ((ret == ESP_OK) && (h2pc_sid == NULL)) ret = H2PC_ERR_PROTOCOL;
+    }
+#ifdef CONFIG_WC_USE_IO_STREAMS
+    if ((ret == ESP_OK) && cm_inc_device && (h2pc_mode & H2PC_MODE_INCOMING))
+        ret = __h2pc_is_open(cm_inc_device);
+    if ((ret == ESP_OK) && cm_out_active) {
+        /* the frames keep their numbering on the new stream */
+        uint32_t seq = out_seq;
+        ret = h2pc_os_prepare(cm_out_subproto);
+        out_seq = seq;
+        if ((ret == ESP_OK) && (out_streaming_strm_id <= 0)) ret = ESP_ERR_INVALID_RESPONSE;
+    }
+#endif
+    if (ret != ESP_OK)
+        __h2pc_sess_close();
+    return ret;
+}
+
+static void __h2pc_cm_recover() {
+    __h2pc_cm_notify(H2PC_CM_LOST);
+    uint32_t attempt = 0;
+    while (!cm_stop) {
+        /* the kick given on stop breaks the wait */
+        xSemaphoreTake(cm_kick, pdMS_TO_TICKS(__h2pc_cm_backoff(attempt)));
+        if (cm_stop) break;
+        attempt++;
+        /* the stats are read by h2pc_cm_get_stats under the session lock */
+        if (__h2pc_sess_lock()) {
+            cm_stats.attempts = attempt;
+            __h2pc_sess_unlock();
+        }
+        int ret = __h2pc_cm_reconnect();
+        if (ret == ESP_OK) {
+            uint32_t dt = (uint32_t)((esp_timer_get_time() - cm_lost_at) / 1000);
+            if (__h2pc_sess_lock()) {
+                cm_stats.reconnects++;
+                cm_stats.last_recover_ms = dt;
+                if (cm_stats.max_recover_ms < dt) cm_stats.max_recover_ms = dt;
+                cm_stats.total_recover_ms += dt;
+                __h2pc_sess_unlock();
+            }
+            cm_lost = false;
+            ESP_LOGI(H2PC_TAG, "Connection recovered in %d ms", dt);
+            __h2pc_cm_notify(H2PC_CM_RECOVERED);
+            /* the queued messages are sent by the owner */
+            h2pc_wakeup();
+            return;
+        }
+        ESP_LOGW(H2PC_TAG, "Reconnect attempt %d failed %d", attempt, ret);
+        if (cm_cfg.max_attempts && (attempt >= cm_cfg.max_attempts)) {
+            if (__h2pc_sess_lock()) {
+                cm_stats.failures++;
+                __h2pc_sess_unlock();
+            }
+            cm_lost = false;
+            h2pc_disconnect_http2();
+            __h2pc_cm_notify(H2PC_CM_FAILED);
+            return;
+        }
+    }
+}
+
+static void __h2pc_cm_task(void * arg) {
+    while (!cm_stop) {
+        if (xSemaphoreTake(cm_kick, portMAX_DELAY) != pdTRUE) continue;
+        if (cm_stop) break;
+        if (cm_lost && !client_connected)
+            __h2pc_cm_recover();
+    }
+
+    xSemaphoreGive(cm_done);
+    vTaskDelete(NULL);
+}
+
+int h2pc_cm_start(const h2pc_cm_config * cfg, h2pc_cb_cm_state on_state, void * user_data,
+                  UBaseType_t priority, BaseType_t core_id) {
+    if (cm_running) return ESP_ERR_INVALID_STATE;
+    if (h2pc_sess_mux == NULL) return ESP_ERR_INVALID_STATE;
+    if ((cfg == NULL) || (cfg->min_backoff_ms == 0) || (cfg->min_backoff_ms > cfg->max_backoff_ms))
+        return ESP_ERR_INVALID_ARG;
+    if (cm_kick == NULL) {
+        cm_kick = xSemaphoreCreateBinary();
+        if (cm_kick == NULL) return ESP_ERR_NO_MEM;
+    }
+    if (cm_done == NULL) {
+        cm_done = xSemaphoreCreateBinary();
+        if (cm_done == NULL) return ESP_ERR_NO_MEM;
+    }
+    xSemaphoreTake(cm_kick, 0);
+
+    cm_cfg = *cfg;
+    cm_cb = on_state;
+    cm_data = user_data;
+    cm_lost = false;
+    cm_stop = false;
+    cm_running = true;
+    if (xTaskCreatePinnedToCore(&__h2pc_cm_task, "h2pc_cm", H2PC_CM_STACK_SIZE,
+                                NULL, priority, NULL, core_id) != pdPASS) {
+        cm_running = false;
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+void h2pc_cm_stop() {
+    if (!cm_running) return;
+    cm_stop = true;
+    xSemaphoreGive(cm_kick);
+    xSemaphoreTake(cm_done, portMAX_DELAY);
+    cm_running = false;
+    if (cm_lost) {
+        /* nobody recovers the connection now */
+        cm_lost = false;
+        h2pc_disconnect_http2();
+    }
+}
+
+bool h2pc_cm_is_recovering() {
+    return cm_lost;
+}
+
+void h2pc_cm_get_stats(h2pc_cm_stats * stats) {
+    memset(stats, 0, sizeof(h2pc_cm_stats));
+    if (h2pc_sess_mux == NULL) return;
+
+    if (__h2pc_sess_lock()) {
+        *stats = cm_stats;
+        __h2pc_sess_unlock();
+    }
+}
+
+cJSON * h2pc_req_ctx_consume(h2pc_req_ctx * ctx) {
+    if (ctx->resp_len > 0)
+        return cJSON_Parse(ctx->resp);
+    else
+        return NULL;
+}
+
+void h2pc_do_post(char * aPath) {
+    h2pc_req_ctx_post(req_def, aPath);
+}
+
+bool h2pc_wait_for_response() {
+    return h2pc_req_ctx_wait(req_def);
+}
+
 cJSON * h2pc_consume_response_content() {
-    if (resp_len > 0) {
-        cJSON * resp = cJSON_Parse(resp_buffer);
-        if (resp) {
-            return resp;
-        } else return NULL;
-    } else return NULL;
+    return h2pc_req_ctx_consume(req_def);
+}
+
+/* resumes the data of the stream and makes one send/receive pass */
+static bool __h2pc_sess_exchange(int32_t strm_id) {
+    int ret = 0;
+    if (__h2pc_sess_lock()) {
+        if (!client_connected) {
+            __h2pc_sess_unlock();
+            return false;
+        }
+        if (strm_id > 0)
+            nghttp2_session_resume_data(hd.http2_sess, strm_id);
+
+        ret = nghttp2_session_recv(hd.http2_sess);
+        if (ret != 0) {
+            ESP_LOGE(H2PC_TAG, "[sh2-frame-send] HTTP2 session recv failed %d", ret);
+        } else {
+            ret = nghttp2_session_send(hd.http2_sess);
+            if (ret != 0)
+                ESP_LOGE(H2PC_TAG, "[sh2-frame-send] HTTP2 session send failed %d", ret);
+        }
+        __h2pc_sess_unlock();
+    }
+    if ((ret != 0) || sess_lost) {
+        __h2pc_conn_lost();
+        return false;
+    }
+    return true;
 }
 
 #ifdef CONFIG_WC_USE_IO_STREAMS
 
+/* rate control. the session is locked */
+static void __h2pc_rc_publish() {
+    if (out_rc_cb)
+        out_rc_cb(out_rc_data, &out_rc);
+}
+
+static void __h2pc_rc_on_frame(uint32_t delay_ms) {
+    if (!out_rc_enabled) return;
+    out_rc.frames++;
+    /* smoothed delay 7/8 old + 1/8 new */
+    out_rc.delay_ms = (out_rc.delay_ms * 7 + delay_ms) / 8;
+    if (delay_ms > out_rc_cfg.target_delay_ms)
+        out_rc_congested = true;
+}
+
+static void __h2pc_rc_on_sent(size_t len) {
+    if (!out_rc_enabled) return;
+    out_rc_bytes += len;
+}
+
+/* throughput, delay and the flow control window are taken once per
+   H2PC_RC_INTERVAL_MS. fps goes up by one while the frames arrive in time
+   and down by 1/4 on the late frames or the exhausted window */
+static void __h2pc_rc_update() {
+    if (!out_rc_enabled) return;
+    int64_t now = esp_timer_get_time();
+    int64_t dt = now - out_rc_last;
+    if (dt < (int64_t)H2PC_RC_INTERVAL_MS * 1000) return;
+    out_rc_last = now;
+
+    uint32_t rate = (uint32_t)(((int64_t)out_rc_bytes * 1000000) / dt);
+    /* an idle sender says nothing about the link capacity */
+    if (out_rc_backlog || (rate > out_rc.throughput))
+        out_rc.throughput = (out_rc.throughput == 0) ? rate : (out_rc.throughput * 3 + rate) / 4;
+    out_rc_bytes = 0;
+
+    /* age of the oldest frame not sent yet */
+    uint32_t head_age = 0;
+    if (out_inflight_first)
+        head_age = (xTaskGetTickCount() - out_inflight_first->pushed_at) * portTICK_PERIOD_MS;
+    else
+    if (bytes_frame && !sending_finished)
+        head_age = (uint32_t)((now - out_rc_frame_start) / 1000);
+
+    out_rc.window = -1;
+    if (hd.http2_sess && (out_streaming_strm_id > 0)) {
+        int32_t w = nghttp2_session_get_stream_remote_window_size(hd.http2_sess, out_streaming_strm_id);
+        int32_t cw = nghttp2_session_get_remote_window_size(hd.http2_sess);
+        out_rc.window = (cw < w) ? cw : w;
+    }
+    if (out_frame_pool && (wcFramePool_frames_cnt(out_frame_pool) > 0))
+        out_rc_backlog = true;
+    bool window_blocked = (out_rc.window >= 0) && out_rc_backlog &&
+                          (out_rc.window < out_rc.frame_budget);
+
+    uint16_t fps = out_rc.target_fps;
+    bool late = out_rc_congested || (head_age > out_rc_cfg.target_delay_ms) ||
+                (out_rc.delay_ms > out_rc_cfg.target_delay_ms);
+    if (late || window_blocked) {
+        /* one decrease per two target delays - let the backlog drain */
+        if ((now - out_rc_last_decrease) >= (int64_t)out_rc_cfg.target_delay_ms * 2000) {
+            fps = (fps * 3) / 4;
+            out_rc_last_decrease = now;
+            out_rc.decreases++;
+        }
+    } else
+    if (out_rc.delay_ms < out_rc_cfg.target_delay_ms / 2)
+        fps++;
+    if (fps < out_rc_cfg.min_fps) fps = out_rc_cfg.min_fps;
+    if (fps > out_rc_cfg.max_fps) fps = out_rc_cfg.max_fps;
+
+    int32_t budget = out_rc.frame_budget;
+    if (out_rc.throughput > 0) {
+        /* keep 1/8 of the link for the headers and the other streams */
+        budget = (int32_t)(((uint64_t)out_rc.throughput * 7 / 8) / fps);
+        if (budget < out_rc_cfg.min_frame_size) budget = out_rc_cfg.min_frame_size;
+        if (budget > out_rc_cfg.max_frame_size) budget = out_rc_cfg.max_frame_size;
+    }
+
+    out_rc_backlog = false;
+    out_rc_congested = false;
+
+    int32_t dbudget = budget - out_rc.frame_budget;
+    if (dbudget < 0) dbudget = -dbudget;
+    if ((fps != out_rc.target_fps) || (dbudget > out_rc.frame_budget / 8)) {
+        out_rc.target_fps = fps;
+        out_rc.frame_budget = budget;
+        __h2pc_rc_publish();
+    }
+}
+
+static void __h2pc_os_frame_done(wc_frame * fr, bool sent) {
+    if (sent)
+        __h2pc_rc_on_frame((xTaskGetTickCount() - fr->pushed_at) * portTICK_PERIOD_MS);
+    if (out_frame_done_cb)
+        out_frame_done_cb(out_frame_done_data, fr, sent);
+    wcFrame_free(fr);
+}
+
+static void __h2pc_os_on_drop(void * data, wc_frame * fr) {
+    /* the pool releases the frame */
+    if (out_frame_done_cb)
+        out_frame_done_cb(out_frame_done_data, fr, false);
+}
+
+/* the session is locked */
+static void __h2pc_os_queue_cancel() {
+    while (out_inflight_first) {
+        wc_frame * fr = out_inflight_first;
+        out_inflight_first = fr->next;
+        fr->next = NULL;
+        __h2pc_os_frame_done(fr, false);
+    }
+    out_inflight_last = NULL;
+    out_inflight_sent = 0;
+    out_frame = NULL;
+    if (out_frame_pool)
+        wcFramePool_clear(out_frame_pool);
+}
+
+static bool __h2pc_os_queue_empty() {
+    return (out_frame_pool == NULL) ||
+           ((out_inflight_first == NULL) && (wcFramePool_frames_cnt(out_frame_pool) == 0));
+}
+
+#ifndef CONFIG_H2PC_DATA_NO_COPY
+/* copies the queued frames back to back. the tail of one frame and
+   the head of the next one may share the data frame */
+static int __h2pc_os_queue_read(char *buf, size_t length) {
+    size_t total = 0;
+    while (total < length) {
+        if (out_frame == NULL) {
+            out_frame = wcFramePool_pop_front(out_frame_pool);
+            if (out_frame == NULL) break;
+            out_frame->pos = 0;
+            out_frame->next = NULL;
+            if (out_inflight_last)
+                out_inflight_last->next = out_frame;
+            else
+                out_inflight_first = out_frame;
+            out_inflight_last = out_frame;
+        }
+        total += wcFrame_readBuffer(out_frame, &(buf[total]), length - total);
+        if (out_frame->pos >= out_frame->size)
+            out_frame = NULL;
+    }
+    return total;
+}
+#else
+/* takes the next queued frame to the transmission. one data frame
+   never crosses the queued frames bounds. returns the length to send */
+static int __h2pc_os_queue_peek(size_t length) {
+    if (out_frame == NULL) {
+        out_frame = wcFramePool_pop_front(out_frame_pool);
+        if (out_frame == NULL) return 0;
+        out_frame->pos = 0;
+        out_frame->next = NULL;
+        if (out_inflight_last)
+            out_inflight_last->next = out_frame;
+        else
+            out_inflight_first = out_frame;
+        out_inflight_last = out_frame;
+    }
+    int32_t left = out_frame->size - out_frame->pos;
+    if (left < length) length = left;
+    return length;
+}
+
+/* writes the body of the frame under transmission straight to tls */
+static int __h2pc_os_queue_write(size_t length) {
+    wc_frame_iovec iov[4];
+    while ((length > 0) && out_frame) {
+        int cnt = wcFrame_get_iov(out_frame, out_frame->pos, iov, 4);
+        if (cnt == 0) break;
+        for (int i = 0; (i < cnt) && (length > 0); i++) {
+            size_t len = iov[i].len;
+            if (len > length) len = length;
+            if (__h2pc_tls_write(iov[i].base, len) != ESP_OK)
+                return ESP_FAIL;
+            out_frame->pos += len;
+            length -= len;
+        }
+    }
+    if (out_frame && (out_frame->pos >= out_frame->size))
+        out_frame = NULL;
+    return (length == 0) ? ESP_OK : ESP_FAIL;
+}
+
+/* writes the part of the raw bytes frame straight to tls */
+static int __h2pc_os_bytes_write(size_t length) {
+    if (bytes_frame_pos < bytes_frame_hdr_len) {
+        size_t len = bytes_frame_hdr_len - bytes_frame_pos;
+        if (len > length) len = length;
+        if (__h2pc_tls_write(&(bytes_frame_hdr[bytes_frame_pos]), len) != ESP_OK)
+            return ESP_FAIL;
+        bytes_frame_pos += len;
+        length -= len;
+    }
+    if (length > 0) {
+        if (__h2pc_tls_write(&(bytes_frame[bytes_frame_pos - bytes_frame_hdr_len]), length) != ESP_OK)
+            return ESP_FAIL;
+        bytes_frame_pos += length;
+    }
+    return ESP_OK;
+}
+#endif
+
+/* releases the frames fully sent */
+static void __h2pc_os_queue_sent(size_t len) {
+    out_inflight_sent += len;
+    while (out_inflight_first && (out_inflight_first != out_frame) &&
+           (out_inflight_sent >= out_inflight_first->size)) {
+        wc_frame * fr = out_inflight_first;
+        out_inflight_sent -= fr->size;
+        out_inflight_first = fr->next;
+        if (out_inflight_first == NULL) out_inflight_last = NULL;
+        fr->next = NULL;
+        __h2pc_os_frame_done(fr, true);
+    }
+}
+
 int send_put_data(struct sh2lib_handle *handle, int32_t stream_id, char *buf, size_t length, uint32_t *data_flags)
 {
+    if ((bytes_frame == NULL) && out_frame_pool) {
+#ifdef CONFIG_H2PC_DATA_NO_COPY
+        int len = __h2pc_os_queue_peek(length);
+        (*data_flags) |= NGHTTP2_DATA_FLAG_NO_COPY;
+#else
+        int len = __h2pc_os_queue_read(buf, length);
+#endif
+        (*data_flags) |= NGHTTP2_DATA_FLAG_NO_END_STREAM;
+        if (len == 0)
+            return NGHTTP2_ERR_DEFERRED;
+        if (wcFramePool_frames_cnt(out_frame_pool) > 0)
+            out_rc_backlog = true;
+        ESP_LOGI(H2PC_TAG, "[data-prvd] Sending %d bytes", len);
+        return len;
+    }
+
     int cur_bytes_tosend_len = bytes_frame_len - bytes_frame_pos;
     if (cur_bytes_tosend_len < length) length = cur_bytes_tosend_len;
+    else out_rc_backlog = true;
 
+#ifdef CONFIG_H2PC_DATA_NO_COPY
+    /* the frame is written by h2pc_send_data_callback, it moves bytes_frame_pos */
+    if (length > 0) {
+        (*data_flags) |= NGHTTP2_DATA_FLAG_NO_COPY;
+        return length;
+    }
+#else
     if ( length > 0 ) {
 
         /* dst - buf,
          * src - bytes_tosend at bytes_tosend_pos */
 
-        int off;
-        if (bytes_frame_pos == 0) {
-            *((uint16_t *)buf) = WEBCAM_FRAME_START_SEQ;
-            uint32_t sz = bytes_frame_len - WEBCAM_FRAME_HEADER_SIZE;
-            *((uint32_t *)&(buf[sizeof(uint16_t)])) = (uint32_t)(sz);
-
-            off = WEBCAM_FRAME_HEADER_SIZE;
+        int off = 0;
+        if (bytes_frame_pos < bytes_frame_hdr_len) {
+            off = bytes_frame_hdr_len - bytes_frame_pos;
+            if (off > length) off = length;
+            memcpy(buf, &(bytes_frame_hdr[bytes_frame_pos]), off);
             bytes_frame_pos += off;
-        } else
-            off = 0;
+        }
 
         size_t len = length - off;
-        memcpy(&(buf[off]), &(bytes_frame[bytes_frame_pos - WEBCAM_FRAME_HEADER_SIZE]), len);
+        memcpy(&(buf[off]), &(bytes_frame[bytes_frame_pos - bytes_frame_hdr_len]), len);
         ESP_LOGI(H2PC_TAG, "[data-prvd] Sending %d bytes", length);
         bytes_frame_pos += len;
     }
+#endif
 
     if (bytes_frame_len == bytes_frame_pos) {
         (*data_flags) |= NGHTTP2_DATA_FLAG_NO_END_STREAM;
@@ -993,9 +3108,15 @@ int handle_response(struct sh2lib_handle *handle, int32_t stream_id, const char
 {
     if (flags == DATA_SEND_FRAME_DATA) {
         size_t lenv = *((size_t*) data);
-        bytes_frame_pos_sended += lenv;
-        if (bytes_frame_pos_sended == bytes_frame_len) {
-            sending_finished = true;
+        __h2pc_rc_on_sent(lenv);
+        if ((bytes_frame == NULL) && out_frame_pool) {
+            __h2pc_os_queue_sent(lenv);
+        } else {
+            bytes_frame_pos_sended += lenv;
+            if (bytes_frame_pos_sended == bytes_frame_len) {
+                sending_finished = true;
+                __h2pc_rc_on_frame((uint32_t)((esp_timer_get_time() - out_rc_frame_start) / 1000));
+            }
         }
     } else
     if (flags == DATA_RECV_FRAME_COMPLETE) {
@@ -1005,9 +3126,11 @@ int handle_response(struct sh2lib_handle *handle, int32_t stream_id, const char
         ESP_LOGI(H2PC_TAG, "[put-response] Stream Closed");
         sending_finished = true;
         out_streaming_strm_id = -1;
+        __h2pc_os_queue_cancel();
     } else
     if ( flags == DATA_RECV_GOAWAY ) {
-        h2pc_disconnect_http2();
+        /* the session can not be freed inside its callbacks */
+        sess_lost = true;
     }
     return NGHTTP2_ERR_WOULDBLOCK;
 }
@@ -1025,12 +3148,23 @@ int h2pc_os_prepare(const char * subproto) {
     memset(aSID, 0, TOKEN_LENGTH);
     h2pc_encode_http_str(h2pc_sid, aSID);
 
+    out_hdr_ver = wcProtocol_frame_header_version(subproto);
+    out_seq = 0;
     if (subproto != NULL)
         sprintf(aPath, HTTP2_STREAMING_OUT_WITH_SP_PATH, aSID, subproto);
     else
         sprintf(aPath, HTTP2_STREAMING_OUT_PATH, aSID);
 
-    out_streaming_strm_id = sh2lib_do_put(&hd, aPath, send_put_data, handle_response);
+    if (__h2pc_sess_lock()) {
+        out_streaming_strm_id = sh2lib_do_put(&hd, aPath, send_put_data, handle_response);
+        __h2pc_stream_set_weight(out_streaming_strm_id, sess_settings.out_weight);
+        __h2pc_sess_unlock();
+    }
+    if (out_streaming_strm_id > 0) {
+        if (subproto != cm_out_subproto)
+            __h2pc_str_set(&cm_out_subproto, subproto);
+        cm_out_active = true;
+    }
     ESP_LOGD(H2PC_TAG, "[data-prvd] Streaming stream id = %d", out_streaming_strm_id);
 
     goto final;
@@ -1043,32 +3177,137 @@ final:
     return ret;
 }
 
+int h2pc_os_start_queue(int16_t frames_limit, int32_t frames_size_limit,
+                        const wc_frame_alloc_class * classes, int classes_cnt,
+                        h2pc_cb_out_frame_done on_done, void * user_data) {
+    if (out_frame_pool) return ESP_ERR_INVALID_STATE;
+
+    wc_frame_pool * pool = wcFramePool_init_alloc(frames_limit, frames_size_limit, classes, classes_cnt);
+    if (pool == NULL) return ESP_ERR_NO_MEM;
+    pool->on_erase_cb = &__h2pc_os_on_drop;
+    pool->on_erase_data = NULL;
+
+    if (__h2pc_sess_lock()) {
+        out_frame_done_cb = on_done;
+        out_frame_done_data = user_data;
+        out_frame_pool = pool;
+        __h2pc_sess_unlock();
+    }
+    return ESP_OK;
+}
+
+void h2pc_os_stop_queue() {
+    if (out_frame_pool == NULL) return;
+    if (__h2pc_sess_lock()) {
+        __h2pc_os_queue_cancel();
+        wcFramePool_free(out_frame_pool);
+        out_frame_pool = NULL;
+        __h2pc_sess_unlock();
+    }
+}
+
+wc_frame * h2pc_os_new_frame(int32_t size) {
+    if (out_frame_pool == NULL) return NULL;
+
+    /* the header fields are filled on the push */
+    unsigned char hdr[WEBCAM_FRAME_HEADER_MAX_SIZE];
+    int32_t hsz = __h2pc_frame_header(hdr, out_hdr_ver, (uint32_t) size, 0, 0, 0);
+    wc_frame * fr = wcFramePool_new_frame(out_frame_pool, size + hsz);
+    if (fr) {
+        wcFrame_writeData(fr, hdr, hsz);
+        /* the header keeps its version if the subprotocol changes before the push */
+        fr->hdr_ver = out_hdr_ver;
+    }
+    return fr;
+}
+
+int h2pc_os_push_frame(wc_frame * frm) {
+    if (out_frame_pool == NULL) {
+        wcFrame_free(frm);
+        return ESP_ERR_INVALID_STATE;
+    }
+    int32_t hsz = (frm->hdr_ver >= 2) ? WEBCAM_FRAME_HEADER_V2_SIZE : WEBCAM_FRAME_HEADER_SIZE;
+    if ((frm->hdr_ver == 0) || (frm->size < hsz)) {
+        /* not created by h2pc_os_new_frame or the header is overwritten */
+        wcFrame_free(frm);
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (__h2pc_sess_lock()) {
+        frm->seq = out_seq++;
+        __h2pc_sess_unlock();
+    }
+    if (frm->stamp == 0) frm->stamp = __h2pc_wall_ms();
+    /* the header is rewritten in place - the producer may write less than
+     * the size requested by h2pc_os_new_frame */
+    unsigned char hdr[WEBCAM_FRAME_HEADER_MAX_SIZE];
+    __h2pc_frame_header(hdr, frm->hdr_ver, frm->size - hsz,
+                        frm->seq, frm->stamp, frm->flags);
+    wcFrame_writeAt(frm, 0, hdr, hsz);
+    /* the pool limits and the drop policy bound the queue */
+    wcFramePool_push_back(out_frame_pool, frm);
+    h2pc_wakeup();
+    return ESP_OK;
+}
+
+int h2pc_os_start_rate_control(const h2pc_os_rate_config * cfg, h2pc_cb_out_rate on_change, void * user_data) {
+    if ((cfg == NULL) || (cfg->min_fps == 0) || (cfg->min_fps > cfg->max_fps) ||
+        (cfg->min_frame_size > cfg->max_frame_size) || (cfg->target_delay_ms == 0))
+        return ESP_ERR_INVALID_ARG;
+
+    if (__h2pc_sess_lock()) {
+        out_rc_cfg = *cfg;
+        memset(&out_rc, 0, sizeof(out_rc));
+        out_rc.target_fps = cfg->max_fps;
+        out_rc.frame_budget = cfg->max_frame_size;
+        out_rc.window = -1;
+        out_rc_cb = on_change;
+        out_rc_data = user_data;
+        out_rc_last = esp_timer_get_time();
+        out_rc_last_decrease = 0;
+        out_rc_bytes = 0;
+        out_rc_backlog = false;
+        out_rc_congested = false;
+        out_rc_enabled = true;
+        __h2pc_sess_unlock();
+        return ESP_OK;
+    }
+    return ESP_ERR_INVALID_STATE;
+}
+
+void h2pc_os_stop_rate_control() {
+    if (__h2pc_sess_lock()) {
+        out_rc_enabled = false;
+        out_rc_cb = NULL;
+        __h2pc_sess_unlock();
+    }
+}
+
+void h2pc_os_get_rate(h2pc_os_rate * rate) {
+    if (__h2pc_sess_lock()) {
+        __h2pc_rc_update();
+        *rate = out_rc;
+        __h2pc_sess_unlock();
+    }
+}
+
 bool h2pc_is_wait_for_frame() {
     bool res = true;
-    int delay = 20;
+    int64_t deadline = esp_timer_get_time() + (int64_t)H2PC_IS_WAIT_MS * 1000;
 
-    while (delay) {
-        if (inc_streaming_strm_id > 0)
-            nghttp2_session_resume_data(hd.http2_sess, inc_streaming_strm_id);
-        else {
+    while (1) {
+        if (inc_streaming_strm_id <= 0) {
             res = false;
             break;
         }
 
-        /* Process HTTP2 send/receive */
-        int ret = nghttp2_session_recv(hd.http2_sess);
-        if (ret != 0) {
-            ESP_LOGE(H2PC_TAG, "[sh2-frame-send] HTTP2 session recv failed %d", ret);
-            h2pc_disconnect_http2();
+        if (!__h2pc_sess_exchange(inc_streaming_strm_id)) {
             res = false;
             break;
         }
-        ret = nghttp2_session_send(hd.http2_sess);
-        if (ret != 0) {
-            ESP_LOGE(H2PC_TAG, "[sh2-frame-send] HTTP2 session send failed %d", ret);
-            h2pc_disconnect_http2();
-            res = false;
-            break;
+
+        if (__h2pc_sess_lock()) {
+            __h2pc_wt_update();
+            __h2pc_sess_unlock();
         }
 
         if ((inc_streaming_strm_id < 0) || (!h2pc_get_connected())) {
@@ -1076,8 +3315,9 @@ bool h2pc_is_wait_for_frame() {
             break;
         }
 
-        vTaskDelay(1);
-        delay--;
+        int left = (int)((deadline - esp_timer_get_time()) / 1000);
+        if (left <= 0) break;
+        __h2pc_wait_io(left);
     }
     return res;
 }
@@ -1086,29 +3326,23 @@ bool h2pc_os_wait_for_frame() {
     bool res = true;
 
     while (1) {
-        if (out_streaming_strm_id > 0)
-            nghttp2_session_resume_data(hd.http2_sess, out_streaming_strm_id);
-
-        /* Process HTTP2 send/receive */
-        int ret = nghttp2_session_recv(hd.http2_sess);
-        if (ret != 0) {
-            ESP_LOGE(H2PC_TAG, "[sh2-frame-send] HTTP2 session recv failed %d", ret);
-            h2pc_disconnect_http2();
+        if (!__h2pc_sess_exchange(out_streaming_strm_id)) {
             res = false;
             break;
         }
-        ret = nghttp2_session_send(hd.http2_sess);
-        if (ret != 0) {
-            ESP_LOGE(H2PC_TAG, "[sh2-frame-send] HTTP2 session send failed %d", ret);
-            h2pc_disconnect_http2();
-            res = false;
-            break;
+
+        if (__h2pc_sess_lock()) {
+            __h2pc_rc_update();
+            __h2pc_sess_unlock();
         }
 
         if (sending_finished || !h2pc_get_connected())
             break;
+        /* the queue is flushed */
+        if ((bytes_frame == NULL) && __h2pc_os_queue_empty())
+            break;
 
-        vTaskDelay(2);
+        __h2pc_wait_io(H2PC_IO_WAIT_MS);
     }
     ESP_LOGD(H2PC_TAG, "Frame sended");
     bytes_frame = NULL;
@@ -1118,6 +3352,67 @@ bool h2pc_os_wait_for_frame() {
     return res;
 }
 
+void h2pc_is_set_subproto(const char * subproto) {
+    if (__h2pc_sess_lock()) {
+        inc_hdr_ver = wcProtocol_frame_header_version(subproto);
+        inc_hdr_size = wcProtocol_frame_header_size(inc_hdr_ver);
+        __h2pc_sess_unlock();
+    }
+}
+
+void h2pc_is_get_stream_stats(h2pc_is_stream_stats * stats) {
+    if (__h2pc_sess_lock()) {
+        *stats = inc_stream_stats;
+        __h2pc_sess_unlock();
+    }
+}
+
+int h2pc_is_set_window_tuning(bool enable, int32_t min_window, int32_t max_window) {
+    if (min_window <= 0) min_window = NGHTTP2_INITIAL_WINDOW_SIZE;
+    if (max_window <= 0) max_window = H2PC_MAX_ALLOWED_FRAMES_SIZE;
+    if (max_window > NGHTTP2_MAX_WINDOW_SIZE) max_window = NGHTTP2_MAX_WINDOW_SIZE;
+    if (min_window > max_window) return ESP_ERR_INVALID_ARG;
+
+    if (__h2pc_sess_lock()) {
+        inc_wt_min = min_window;
+        inc_wt_max = max_window;
+        inc_wt_enabled = enable;
+        if (enable && (inc_wt.window == 0))
+            inc_wt.window = __h2pc_wt_initial();
+        __h2pc_sess_unlock();
+        return ESP_OK;
+    }
+    return ESP_ERR_INVALID_STATE;
+}
+
+void h2pc_is_get_window_stats(h2pc_is_window_stats * stats) {
+    if (__h2pc_sess_lock()) {
+        *stats = inc_wt;
+        __h2pc_sess_unlock();
+    }
+}
+
+void h2pc_is_set_resync(bool enable) {
+    inc_resync = enable;
+}
+
+uint32_t h2pc_is_get_resyncs_cnt() {
+    return inc_resyncs_cnt;
+}
+
+uint32_t h2pc_is_get_bytes_skipped() {
+    return inc_bytes_skipped;
+}
+
+void h2pc_is_set_fanout(wc_frame_fanout * inc_fanout) {
+    if (h2pc_mode & H2PC_MODE_INCOMING) {
+        if (__inc_frames_lock()) {
+            inc_frame_fanout = inc_fanout;
+            __inc_frames_unlock();
+        }
+    }
+}
+
 void h2pc_is_set_pool(wc_frame_pool * inc_pool, h2pc_cb_inc_frame_analyse analyser, void * user_data) {
     if (h2pc_mode & H2PC_MODE_INCOMING) {
         if (__inc_frames_lock()) {
@@ -1129,15 +3424,81 @@ void h2pc_is_set_pool(wc_frame_pool * inc_pool, h2pc_cb_inc_frame_analyse analys
     }
 }
 
+int h2pc_is_start_analyser(int queue_len, UBaseType_t priority, BaseType_t core_id) {
+    if ((h2pc_mode & H2PC_MODE_INCOMING) == 0) return ESP_ERR_INVALID_STATE;
+    if (inc_analyser_queue) return ESP_ERR_INVALID_STATE;
+    if (queue_len <= 0) return ESP_ERR_INVALID_ARG;
+
+    QueueHandle_t queue = xQueueCreate(queue_len, sizeof(wc_frame *));
+    if (queue == NULL) return ESP_ERR_NO_MEM;
+    if (inc_analyser_done == NULL) {
+        inc_analyser_done = xSemaphoreCreateBinary();
+        if (inc_analyser_done == NULL) {
+            vQueueDelete(queue);
+            return ESP_ERR_NO_MEM;
+        }
+    }
+
+    if (xTaskCreatePinnedToCore(&__inc_analyser_task, "h2pc_analyser", H2PC_ANALYSER_STACK_SIZE,
+                                queue, priority, NULL, core_id) != pdPASS) {
+        vQueueDelete(queue);
+        return ESP_ERR_NO_MEM;
+    }
+
+    if (__inc_frames_lock()) {
+        memset(&inc_analyser_stats, 0, sizeof(h2pc_analyser_stats));
+        inc_analyser_queue = queue;
+        __inc_frames_unlock();
+    }
+    return ESP_OK;
+}
+
+void h2pc_is_stop_analyser() {
+    QueueHandle_t queue = NULL;
+    if (inc_analyser_queue == NULL) return;
+    if (__inc_frames_lock()) {
+        queue = inc_analyser_queue;
+        inc_analyser_queue = NULL;
+        __inc_frames_unlock();
+    }
+    if (queue == NULL) return;
+
+    /* frames already queued are analysed before the stop request */
+    wc_frame * aFrame = NULL;
+    xQueueSend(queue, &aFrame, portMAX_DELAY);
+    xSemaphoreTake(inc_analyser_done, portMAX_DELAY);
+    vQueueDelete(queue);
+}
+
+void h2pc_is_get_analyser_stats(h2pc_analyser_stats * stats) {
+    memset(stats, 0, sizeof(h2pc_analyser_stats));
+    if ((h2pc_mode & H2PC_MODE_INCOMING) == 0) return;
+    if (__inc_frames_lock()) {
+        memcpy(stats, &inc_analyser_stats, sizeof(h2pc_analyser_stats));
+        stats->queue_depth = inc_analyser_queue ? uxQueueMessagesWaiting(inc_analyser_queue) : 0;
+        __inc_frames_unlock();
+    }
+}
+
 int h2pc_is_launch(const char * device_name, wc_frame_pool * inc_pool,
                        h2pc_cb_inc_frame_analyse analyser, void* analyser_data ) {
     if ((h2pc_mode & H2PC_MODE_INCOMING) == 0) return ESP_ERR_INVALID_STATE;
     if (!h2pc_sid) return ESP_ERR_INVALID_STATE;
 
-    int res = ESP_OK;
-    if (device_name) {
-        h2pc_is_set_pool(inc_pool, analyser, analyser_data);
+    if (device_name == NULL) return ESP_ERR_INVALID_ARG;
+
+    h2pc_is_set_pool(inc_pool, analyser, analyser_data);
+    inc_resyncs_cnt = 0;
+    inc_bytes_skipped = 0;
+    memset(&inc_stream_stats, 0, sizeof(inc_stream_stats));
+    inc_seq_next = 0;
+    return __h2pc_is_open(device_name);
+}
 
+/* opens the incoming stream with the frame pools already set */
+static int __h2pc_is_open(const char * device_name) {
+    int res = ESP_OK;
+    {
         char * aPath = NULL;
         char * aSID = NULL;
         char * aDevice = NULL;
@@ -1156,11 +3517,25 @@ int h2pc_is_launch(const char * device_name, wc_frame_pool * inc_pool,
 
         sprintf(aPath, HTTP2_STREAMING_INP_PATH, aSID, aDevice);
 
-        inc_streaming_strm_id = sh2lib_do_get(&hd, aPath, handle_frame_response);
+        if (__h2pc_sess_lock()) {
+            inc_streaming_strm_id = sh2lib_do_get(&hd, aPath, handle_frame_response);
+            __h2pc_stream_set_weight(inc_streaming_strm_id, sess_settings.inc_weight);
+            memset(&inc_wt, 0, sizeof(inc_wt));
+            inc_wt.window = __h2pc_wt_initial();
+            inc_wt_last = esp_timer_get_time();
+            inc_wt_bytes = 0;
+            inc_wt_stalls = 0;
+            if (inc_wt_enabled && (inc_streaming_strm_id > 0))
+                __h2pc_wt_apply(inc_wt.window);
+            __h2pc_sess_unlock();
+        }
         ESP_LOGD(H2PC_TAG, "[data-prvd] Streaming stream id = %d", inc_streaming_strm_id);
 
         if (inc_streaming_strm_id <= 0)
             res = ESP_ERR_INVALID_RESPONSE;
+        else
+        if (device_name != cm_inc_device)
+            __h2pc_str_set(&cm_inc_device, device_name);
 
         goto final;
 
@@ -1170,18 +3545,72 @@ int h2pc_is_launch(const char * device_name, wc_frame_pool * inc_pool,
         if (aSID) free(aSID);
         if (aDevice) free(aDevice);
         if (aPath) free(aPath);
-    } else
-        res = ESP_ERR_INVALID_ARG;
+    }
 
     return res;
 }
 
 void h2pc_is_stop() {
+    __h2pc_str_clr(&cm_inc_device, false);
     if (inc_streaming_strm_id > 0) {
-        if (hd.http2_sess) {
-            nghttp2_submit_rst_stream(hd.http2_sess, NGHTTP2_FLAG_NONE, inc_streaming_strm_id, NGHTTP2_REFUSED_STREAM);
+        if (__h2pc_sess_lock()) {
+            if (hd.http2_sess)
+                nghttp2_submit_rst_stream(hd.http2_sess, NGHTTP2_FLAG_NONE, inc_streaming_strm_id, NGHTTP2_REFUSED_STREAM);
+            __h2pc_sess_unlock();
         }
     }
 }
 
 #endif
+
+#ifdef CONFIG_H2PC_DATA_NO_COPY
+int h2pc_send_data_callback(nghttp2_session *session, nghttp2_frame *frame, const uint8_t *framehd,
+                            size_t length, nghttp2_data_source *source, void *user_data)
+{
+    int32_t stream_id = frame->hd.stream_id;
+    size_t padlen = frame->data.padlen;
+
+    if (__h2pc_tls_write(framehd, 9) != ESP_OK)
+        return NGHTTP2_ERR_CALLBACK_FAILURE;
+    if (padlen > 0) {
+        uint8_t b = (uint8_t)(padlen - 1);
+        if (__h2pc_tls_write(&b, 1) != ESP_OK)
+            return NGHTTP2_ERR_CALLBACK_FAILURE;
+    }
+
+    int ret = ESP_OK;
+#ifdef CONFIG_WC_USE_IO_STREAMS
+    if (stream_id == out_streaming_strm_id) {
+        if ((bytes_frame == NULL) && out_frame_pool)
+            ret = __h2pc_os_queue_write(length);
+        else
+            ret = __h2pc_os_bytes_write(length);
+    } else
+#endif
+    {
+        h2pc_req_ctx * ctx = __h2pc_req_find(stream_id);
+        if ((ctx == NULL) || (ctx->tosend == NULL) ||
+            (ctx->tosend_pos + (int) length > ctx->tosend_len))
+            return NGHTTP2_ERR_CALLBACK_FAILURE;
+        ret = __h2pc_tls_write(&(ctx->tosend[ctx->tosend_pos]), length);
+        if (ret == ESP_OK) {
+            ESP_LOGI(H2PC_TAG, "[data-prvd] Sending %d bytes", length);
+            ctx->tosend_pos += length;
+        }
+    }
+    if (ret != ESP_OK)
+        return NGHTTP2_ERR_CALLBACK_FAILURE;
+
+    if (padlen > 1) {
+        static const uint8_t zeros[16] = {0};
+        size_t left = padlen - 1;
+        while (left > 0) {
+            size_t len = (left > sizeof(zeros)) ? sizeof(zeros) : left;
+            if (__h2pc_tls_write(zeros, len) != ESP_OK)
+                return NGHTTP2_ERR_CALLBACK_FAILURE;
+            left -= len;
+        }
+    }
+    return 0;
+}
+#endif
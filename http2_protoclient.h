@@ -24,6 +24,10 @@
 #include "wcframe.h"
 #endif
 #include "wcprotocol.h"
+#include "wcjson.h"
+#ifdef CONFIG_H2PC_DATA_NO_COPY
+#include <nghttp2/nghttp2.h>
+#endif
 
 // http2 client mode
 #define H2PC_MODE_MESSAGING  0x01
@@ -36,18 +40,48 @@
 #define H2PC_ERR_PROTOCOL      0x5002
 #define H2PC_ERR_INTERNAL      0x5010
 
+// socket wait config
+#define H2PC_IO_WAIT_MS  100    // longest single socket wait
+#define H2PC_IS_WAIT_MS  200    // time to receive incoming frames per h2pc_is_wait_for_frame
+
+// network task config
+#define H2PC_NET_STACK_SIZE  6144
+// connection manager config
+#define H2PC_CM_STACK_SIZE   6144
+
+// connection manager states
+#define H2PC_CM_LOST         1
+#define H2PC_CM_RECOVERED    2
+#define H2PC_CM_FAILED       3
+
 // response buffer config
 #define H2PC_INITIAL_RESP_BUFFER CONFIG_H2PC_INITIAL_RESP_BUFFER
 #define H2PC_MAXIMUM_RESP_BUFFER CONFIG_H2PC_MAXIMUM_RESP_BUFFER
 
+// buckets of the incoming message handlers
+#define H2PC_IM_HANDLERS_BUCKETS 16
+// queue age histogram of the outgoing batches: <10, <50, <100, <500, <1000, >=1000 ms
+#define H2PC_OM_AGE_BUCKETS      6
+
 #ifdef CONFIG_WC_USE_IO_STREAMS
 // incoming frames config
 #define H2PC_MAX_ALLOWED_FRAMES      CONFIG_H2PC_MAX_ALLOWED_FRAMES
 #define H2PC_MAX_ALLOWED_FRAMES_SIZE CONFIG_H2PC_MAX_ALLOWED_FRAMES_SIZE
+// size of the ring for frame headers split between chunks
+#define H2PC_FRAME_HEADER_RING_SIZE  0x40
+// stack size of the frame analyser task
+#define H2PC_ANALYSER_STACK_SIZE     4096
+// period of the outgoing rate updates
+#define H2PC_RC_INTERVAL_MS          500
+// receive window tuning
+#define H2PC_WT_INTERVAL_MS          250
+#define H2PC_WT_HIGH_FILL            75     // pool fill in percent to halve the window
+#define H2PC_WT_LOW_FILL             50     // pool fill in percent to allow the growth
 
 // incomig frames defines
 #define H2PC_FST_WAITING_START_OF_FRAME 0
 #define H2PC_FST_WAITING_DATA 1
+#define H2PC_FST_RESYNC 2
 
 // kinds of datastreams
 #define H2PC_OUT_STREAM 1
@@ -58,10 +92,146 @@
 extern const char const UPPER_XDIGITS[];
 
 #ifdef CONFIG_WC_USE_IO_STREAMS
+/* the analyser may mark frm->flags with WC_FRAME_FLAG_KEYFRAME for the pool drop policies */
 typedef bool (* h2pc_cb_inc_frame_analyse)(void * user_data, wc_frame * frm, int offset);
+/* called when the queued outgoing frame is sent or dropped. the frame is released after the call */
+typedef void (* h2pc_cb_out_frame_done)(void * user_data, wc_frame * frm, bool sent);
 typedef bool (* h2pc_cb_stream_next_device)(const cJSON * device, const cJSON * dev_name, const cJSON * sub_proto);
+
+typedef struct {
+    uint32_t queue_depth;     // frames waiting for the analyser task
+    uint32_t queue_max_depth;
+    uint32_t dropped;         // frames dropped on the full analyser queue
+    uint32_t frames;          // frames passed through the analyser
+    uint32_t last_us;         // analyser time of the last frame
+    uint32_t max_us;
+    uint64_t total_us;
+} h2pc_analyser_stats;
+
+typedef struct {
+    uint16_t min_fps;
+    uint16_t max_fps;
+    int32_t  min_frame_size;    // bounds of the recommended frame size in bytes
+    int32_t  max_frame_size;
+    uint32_t target_delay_ms;   // longest wanted time from the frame push to its sending
+} h2pc_os_rate_config;
+
+typedef struct {
+    uint16_t target_fps;        // recommended frames per second
+    int32_t  frame_budget;      // recommended frame size in bytes
+    uint32_t throughput;        // estimated send rate in bytes per second
+    uint32_t delay_ms;          // smoothed time from the frame push to its sending
+    int32_t  window;            // remote flow control window of the stream or -1
+    uint32_t frames;            // frames sent
+    uint32_t decreases;         // rate decreases on the late frames or the exhausted window
+} h2pc_os_rate;
+
+typedef struct {
+    uint32_t frames;            // frames received
+    uint32_t lost;              // frames missed in the sequence (v2 frame header)
+    uint32_t reordered;         // frames came late or repeated
+    uint32_t last_seq;
+    uint32_t latency_ms;        // from the capture to the receive of the last frame
+    uint32_t avg_latency_ms;    // smoothed latency
+    uint32_t max_latency_ms;
+} h2pc_is_stream_stats;
+
+typedef struct {
+    int32_t  window;            // receive window of the incoming stream
+    uint32_t throughput;        // bytes per second of the last interval
+    uint32_t best_throughput;   // the best throughput since the last probe start
+    uint8_t  fill;              // fill of the incoming pool in percent
+    bool     plateau;           // the window growth gives no throughput
+    uint32_t grows;
+    uint32_t shrinks;
+} h2pc_is_window_stats;
+
+/* called with the new recommendation. called from the task serving the session */
+typedef void (* h2pc_cb_out_rate)(void * user_data, const h2pc_os_rate * rate);
 #endif
+typedef void (* h2pc_cb_req_done)(int result, void * user_data);
+
+/* http2 session tuning. zero fields keep the sh2lib/nghttp2 defaults */
+typedef struct {
+    int32_t  initial_window_size;    // stream window announced to the server
+    int32_t  connection_window_size; // connection window announced to the server
+    uint32_t max_frame_size;         // largest frame accepted from the server
+    uint32_t header_table_size;      // hpack decoder table size
+    /* stream weights 1..256. the json requests with the higher weight than
+       the video streams get their data frames out first */
+    int32_t  msgs_weight;
+    int32_t  out_weight;
+    int32_t  inc_weight;
+} h2pc_settings;
+
+#define H2PC_SETTINGS_DEFAULT {0, 0, 0, 0, 0, 0, 0}
+
+typedef struct {
+    uint32_t min_backoff_ms;    // delay before the first reconnect attempt
+    uint32_t max_backoff_ms;    // the delay doubles up to this cap
+    uint32_t max_attempts;      // 0 - retry until h2pc_cm_stop
+} h2pc_cm_config;
+
+typedef struct {
+    uint32_t disconnects;       // lost connections
+    uint32_t reconnects;        // recovered connections
+    uint32_t failures;          // recoveries given up after max_attempts
+    uint32_t attempts;          // attempts of the last recovery
+    uint32_t last_recover_ms;   // time from the loss to the reopened streams
+    uint32_t max_recover_ms;
+    uint64_t total_recover_ms;
+} h2pc_cm_stats;
+
+/* H2PC_CM_* state changes. called from the manager task */
+typedef void (* h2pc_cb_cm_state)(void * user_data, int state);
+
+/* state of one json request. many requests share the http2 connection */
+typedef struct h2pc_req_ctx {
+    int32_t strm_id;            // stream of the request in flight or -1
+    char *  tosend;             // raw bytes request content
+    int     tosend_len;
+    int     tosend_pos;
+    bool    need_to_free;       // is tosend (tosend_json) need to free after request sent
+    const cJSON * tosend_json;  // request tree written straight to the DATA frames
+    wc_json_writer writer;
+    wc_json_splitter * splitter;  // passes the array items of the response while it is received
+    char *  resp;               // response content
+    int     resp_len;
+    int     resp_size;
+    volatile bool finished;     // is the request finished
+    const char * path;          // request path
+    bool    path_need_to_free;
+    int  (* finish)(struct h2pc_req_ctx * ctx); // extracts the result from the response
+    void *  finish_data;
+    h2pc_cb_req_done on_done;   // async completion. called from the network task
+    void *  user_data;
+    SemaphoreHandle_t waiter;   // given on completion when the network task serves the request
+    struct h2pc_req_ctx * next;
+} h2pc_req_ctx;
+
 typedef bool (* h2pc_cb_next_msg)(const cJSON * src, const cJSON * kind, const cJSON * params, const cJSON * msg_id);
+/* batching of the outgoing messages. the network task sends the pool
+ * as soon as one of the limits is reached. zero limit is off.
+ * the limits are checked only while the task runs (h2pc_net_start) -
+ * without it the pool waits for h2pc_req_send_msgs_sync */
+typedef struct {
+    uint16_t max_msgs;          // queued messages
+    uint32_t max_bytes;         // serialized size of the queued messages
+    uint32_t max_age_ms;        // time the oldest queued message waits
+    bool     coalesce;          // the message replaces the queued one of the same kind to the same target
+} h2pc_om_batch_config;
+
+typedef struct {
+    uint32_t flushes;           // batches sent by the policy
+    uint32_t by_msgs;           // ... because of the limits
+    uint32_t by_bytes;
+    uint32_t by_age;
+    uint32_t coalesced;         // messages replaced by the later ones
+    uint32_t age_hist[H2PC_OM_AGE_BUCKETS]; // age of the oldest message of the sent batch
+} h2pc_om_batch_stats;
+
+/* handler of the messages of one kind */
+typedef bool (* h2pc_cb_msg_handler)(const cJSON * src, const cJSON * params, const cJSON * msg_id, void * user_data);
 
 int  h2pc_initialize(int mode);
 void h2pc_reset_buffers();
@@ -87,6 +257,9 @@ void h2pc_om_add_msg(const char * amsg, const char * atarget, cJSON * content);
 void h2pc_om_add_msg_res(const char * amsg, const char * atarget, cJSON * content, bool ok);
 void h2pc_om_add_msg_res_code(const char * amsg, const char * atarget, cJSON * content, int error_code);
 bool h2pc_om_locked_waiting();
+/* acts only while the network task runs (h2pc_net_start). NULL turns the batching off */
+int  h2pc_om_set_batching(const h2pc_om_batch_config * cfg);
+void h2pc_om_get_batch_stats(h2pc_om_batch_stats * stats);
 bool h2pc_om_lock();
 cJSON * h2pc_om_get_pool();
 void h2pc_om_set_pool(cJSON * data);
@@ -94,6 +267,15 @@ void h2pc_om_clr_pool();
 void h2pc_om_unlock();
 /* incoming messages */
 void h2pc_im_proceed(h2pc_cb_next_msg on_next_msg, int limit_cnt);
+/* the messages are passed to on_next_msg while getMsgs response is received -
+ * by the network task between the exchanges or when the request is finished.
+ * no locks are held while it is called.
+ * if it returns false the rest is pooled for h2pc_im_proceed */
+void h2pc_im_set_dispatcher(h2pc_cb_next_msg on_next_msg);
+/* the messages of the registered kinds go to their handlers,
+ * the rest - to the on_next_msg callback */
+int  h2pc_im_register_handler(const char * kind, h2pc_cb_msg_handler handler, void * user_data);
+void h2pc_im_unregister_handler(const char * kind);
 bool h2pc_im_locked_waiting();
 bool h2pc_im_lock();
 cJSON * h2pc_im_get_pool();
@@ -108,30 +290,112 @@ int h2pc_req_authorize_sync(const char * name, const char * pwrd, const char * d
 int h2pc_req_get_streams_sync(h2pc_cb_stream_next_device on_next_device);
 #endif
 int h2pc_req_send_msgs_sync();
-int h2pc_req_send_media_record_sync();
+int h2pc_req_send_media_record_sync(const char * buf, size_t sz);
 int h2pc_req_get_msgs_sync();
 
+/* async helpers. the network task must be started.
+   on_done is called from the network task. the record buf must live until on_done */
+int h2pc_req_authorize_async(const char * name, const char * pwrd, const char * dev, cJSON * meta, bool is_own_meta,
+                             h2pc_cb_req_done on_done, void * user_data);
+#ifdef CONFIG_WC_USE_IO_STREAMS
+int h2pc_req_get_streams_async(h2pc_cb_stream_next_device on_next_device,
+                               h2pc_cb_req_done on_done, void * user_data);
+#endif
+int h2pc_req_send_msgs_async(h2pc_cb_req_done on_done, void * user_data);
+int h2pc_req_send_media_record_async(const char * buf, size_t sz,
+                                     h2pc_cb_req_done on_done, void * user_data);
+int h2pc_req_get_msgs_async(h2pc_cb_req_done on_done, void * user_data);
+
+/* network task. serves the http2 session of all the requests and streams */
+int  h2pc_net_start(UBaseType_t priority, BaseType_t core_id);
+void h2pc_net_stop();
+bool h2pc_net_is_running();
+
+/* connection manager. after the session failure it reconnects to the last server
+   with the jittered exponential backoff, authorizes with the last credentials
+   and reopens the incoming and outgoing streams. the outgoing messages are kept */
+int  h2pc_cm_start(const h2pc_cm_config * cfg, h2pc_cb_cm_state on_state, void * user_data,
+                   UBaseType_t priority, BaseType_t core_id);
+void h2pc_cm_stop();
+bool h2pc_cm_is_recovering();
+void h2pc_cm_get_stats(h2pc_cm_stats * stats);
+
+/* request contexts */
+h2pc_req_ctx * h2pc_req_ctx_new();
+void    h2pc_req_ctx_free(h2pc_req_ctx * ctx);
+void    h2pc_req_ctx_prepare(h2pc_req_ctx * ctx, cJSON * tosend);
+int     h2pc_req_ctx_prepare_json(h2pc_req_ctx * ctx, cJSON * tosend, bool is_own);
+void    h2pc_req_ctx_prepare_static(h2pc_req_ctx * ctx, char * buf, int size);
+int     h2pc_req_ctx_post(h2pc_req_ctx * ctx, const char * aPath);
+bool    h2pc_req_ctx_wait(h2pc_req_ctx * ctx);
+cJSON * h2pc_req_ctx_consume(h2pc_req_ctx * ctx);
+
 /* low-level network methods */
 bool h2pc_connect_to_http2(char * aserver);
+/* settings are kept for the next connections. NULL keeps the last ones */
+bool h2pc_connect_to_http2_ext(char * aserver, const h2pc_settings * settings);
 void h2pc_prepare_to_send(cJSON * tosend);
 void h2pc_prepare_to_send_static(char * buf, int size);
 void h2pc_do_post(char * aPath);
 bool h2pc_wait_for_response();
+void h2pc_wakeup();
 cJSON * h2pc_consume_response_content();
 void h2pc_disconnect_http2();
+#ifdef CONFIG_H2PC_DATA_NO_COPY
+/* nghttp2 send_data_callback. writes the outgoing data straight to tls
+   from the request and frame buffers. set to the session created by h2pc_connect_to_http2 */
+int  h2pc_send_data_callback(nghttp2_session *session, nghttp2_frame *frame, const uint8_t *framehd,
+                             size_t length, nghttp2_data_source *source, void *user_data);
+#endif
 
 #ifdef CONFIG_WC_USE_IO_STREAMS
 /* incoming streaming */
 int  h2pc_is_launch(const char * device_name, wc_frame_pool * inc_pool,
                        h2pc_cb_inc_frame_analyse analyser, void* analyser_data );
 void h2pc_is_set_pool(wc_frame_pool * inc_pool, h2pc_cb_inc_frame_analyse analyser, void * user_data);
+void h2pc_is_set_fanout(wc_frame_fanout * inc_fanout);
+/* the frame header version follows the subproto of the device (see WEBCAM_SUBPROTO_V2_SUFFIX).
+   call before h2pc_is_launch */
+void h2pc_is_set_subproto(const char * subproto);
+void h2pc_is_get_stream_stats(h2pc_is_stream_stats * stats);
+/* the receive windows follow the throughput and the incoming pool fill.
+   zero min_window/max_window are the nghttp2 default and H2PC_MAX_ALLOWED_FRAMES_SIZE */
+int  h2pc_is_set_window_tuning(bool enable, int32_t min_window, int32_t max_window);
+void h2pc_is_get_window_stats(h2pc_is_window_stats * stats);
+void h2pc_is_set_resync(bool enable);
+uint32_t h2pc_is_get_resyncs_cnt();
+uint32_t h2pc_is_get_bytes_skipped();
+/* the analyser is called from a separate task fed by a bounded queue.
+   core_id is tskNO_AFFINITY for an unpinned task */
+int  h2pc_is_start_analyser(int queue_len, UBaseType_t priority, BaseType_t core_id);
+void h2pc_is_stop_analyser();
+void h2pc_is_get_analyser_stats(h2pc_analyser_stats * stats);
 bool h2pc_is_wait_for_frame();
 void h2pc_is_stop();
 
 /* outgoing streaming */
+/* the subproto ending with WEBCAM_SUBPROTO_V2_SUFFIX turns on the v2 frame header.
+   h2pc_os_new_frame frames are made after the prepare */
 int  h2pc_os_prepare(const char * subproto);
 void h2pc_os_prepare_frame(char * buf, int size);
+/* stamp is the capture time in ms or 0 for now. flags are WC_FRAME_FLAG_* */
+void h2pc_os_prepare_frame_ext(char * buf, int size, uint32_t stamp, uint16_t flags);
 bool h2pc_os_wait_for_frame();
+/* outgoing frames queue. the frames are sent by the network task
+   or by h2pc_os_wait_for_frame until the queue is flushed */
+int  h2pc_os_start_queue(int16_t frames_limit, int32_t frames_size_limit,
+                         const wc_frame_alloc_class * classes, int classes_cnt,
+                         h2pc_cb_out_frame_done on_done, void * user_data);
+void h2pc_os_stop_queue();
+wc_frame * h2pc_os_new_frame(int32_t size);
+/* the frame gets the next seq. frm->stamp is the capture time in ms or 0 for now.
+   frames not made by h2pc_os_new_frame are freed with ESP_ERR_INVALID_ARG */
+int  h2pc_os_push_frame(wc_frame * frm);
+/* send-side rate control. the camera may follow target_fps and
+   frame_budget (e.g. with the jpeg quality) to keep the latency stable */
+int  h2pc_os_start_rate_control(const h2pc_os_rate_config * cfg, h2pc_cb_out_rate on_change, void * user_data);
+void h2pc_os_stop_rate_control();
+void h2pc_os_get_rate(h2pc_os_rate * rate);
 #endif
 
 
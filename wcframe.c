@@ -19,11 +19,46 @@
 
 static const char *TAG = "WC_FRAME";
 
+static wc_frame_alloc * __wcFrameAlloc_init(const wc_frame_alloc_class * classes, int16_t classes_cnt,
+                                            int16_t headers_per_buf);
+static wc_frame * __wcFrame_new(wc_frame_alloc * alloc, int32_t seg_size, int32_t capacity);
+
 /* wcFramePool */
 
 wc_frame_pool * wcFramePool_init(int16_t frames_limit, int32_t frames_size_limit) {
+    return wcFramePool_init_ext(frames_limit, frames_size_limit, WC_FRAME_POOL_LOCKED, NULL, 0);
+}
+
+wc_frame_pool * wcFramePool_init_alloc(int16_t frames_limit, int32_t frames_size_limit,
+                                       const wc_frame_alloc_class * classes, int16_t classes_cnt) {
+    return wcFramePool_init_ext(frames_limit, frames_size_limit, WC_FRAME_POOL_LOCKED, classes, classes_cnt);
+}
+
+wc_frame_pool * wcFramePool_init_ext(int16_t frames_limit, int32_t frames_size_limit, uint8_t mode,
+                                     const wc_frame_alloc_class * classes, int16_t classes_cnt) {
     wc_frame_pool * res = malloc(sizeof(wc_frame_pool));
     if (res == NULL) return NULL;
+    memset(res, 0, sizeof(wc_frame_pool));
+
+    res->mode = mode;
+    if (mode == WC_FRAME_POOL_SPSC) {
+        /* one spare slot - the producer pushes first and then drops to the limit */
+        res->ring_cap = frames_limit + 1;
+        res->ring = malloc(sizeof(wc_frame *) * res->ring_cap);
+        if (res->ring == NULL) goto error_no_memory;
+    } else {
+        res->mux = xSemaphoreCreateMutex();
+        if (res->mux == NULL) goto error_no_memory;
+    }
+
+    /* consumers waiting for frames are woken by push_back */
+    res->avail = xSemaphoreCreateBinary();
+    if (res->avail == NULL) goto error_no_memory;
+
+    if (classes && (classes_cnt > 0)) {
+        res->alloc = wcFrameAlloc_init(classes, classes_cnt);
+        if (res->alloc == NULL) goto error_no_memory;
+    }
 
     res->first_frame = NULL;
     res->last_frame = NULL;
@@ -34,20 +69,75 @@ wc_frame_pool * wcFramePool_init(int16_t frames_limit, int32_t frames_size_limit
 
     res->cnt_limit = frames_limit;
     res->sz_limit = frames_size_limit;
-
-    res->mux = xSemaphoreCreateMutex();
+    res->drop_policy = WC_FRAME_DROP_OLDEST;
 
     return res;
+
+error_no_memory:
+    if (res->ring) free(res->ring);
+    if (res->mux) vSemaphoreDelete(res->mux);
+    if (res->avail) vSemaphoreDelete(res->avail);
+    free(res);
+    return NULL;
+}
+
+wc_frame * wcFramePool_new_frame(wc_frame_pool * pool, int32_t capacity) {
+    if (!pool) return wcFrame_init_cap(capacity);
+    return __wcFrame_new(pool->alloc, pool->seg_size, capacity);
+}
+
+void wcFramePool_set_segmented(wc_frame_pool * pool, int32_t seg_size) {
+    if (!pool) return;
+    pool->seg_size = seg_size;
+}
+
+int16_t wcFramePool_frames_cnt(wc_frame_pool * pool) {
+    if (!pool) return 0;
+    if (pool->mode == WC_FRAME_POOL_SPSC)
+        return (int16_t)(__atomic_load_n(&pool->tail, __ATOMIC_ACQUIRE) -
+                         __atomic_load_n(&pool->head, __ATOMIC_ACQUIRE));
+    return pool->frames_cnt;
+}
+
+int32_t wcFramePool_frames_size(wc_frame_pool * pool) {
+    if (!pool) return 0;
+    return __atomic_load_n(&pool->total_frames_size, __ATOMIC_RELAXED);
+}
+
+uint8_t wcFramePool_fill(wc_frame_pool * pool) {
+    if (!pool) return 0;
+    int32_t res = 0;
+    if (pool->cnt_limit > 0)
+        res = (int32_t)wcFramePool_frames_cnt(pool) * 100 / pool->cnt_limit;
+    if (pool->sz_limit > 0) {
+        int32_t sz = (int32_t)(((int64_t)wcFramePool_frames_size(pool) * 100) / pool->sz_limit);
+        if (sz > res) res = sz;
+    }
+    return (res > 100) ? 100 : (uint8_t)res;
 }
 
 bool wcFramePool_lock(wc_frame_pool * pool) {
     if (!pool) return false;
+    /* the ring of the spsc pool needs no lock */
+    if (pool->mode == WC_FRAME_POOL_SPSC) return true;
     return (xSemaphoreTake(pool->mux, portMAX_DELAY) == pdTRUE);
 }
 
 void wcFramePool_unlock(wc_frame_pool * pool) {
     if (!pool) return;
+    if (pool->mode == WC_FRAME_POOL_SPSC) return;
+    /* the erased frames are passed to on_erase_cb out of the lock */
+    wc_frame * erased = pool->erased;
+    pool->erased = NULL;
     xSemaphoreGive(pool->mux);
+    while (erased) {
+        wc_frame * fr = erased;
+        erased = fr->next;
+        fr->next = NULL;
+        if (pool->on_erase_cb)
+            pool->on_erase_cb(pool->on_erase_data, fr);
+        wcFrame_free(fr);
+    }
 }
 
 void wcFramePool_push_back(wc_frame_pool * pool, wc_frame * fr) {
@@ -61,8 +151,38 @@ void wcFramePool_push_back(wc_frame_pool * pool, wc_frame * fr) {
     }
 }
 
-void wcFramePool_push_back_nonsafe(wc_frame_pool * pool, wc_frame * fr) {
+/* single producer side of the spsc ring */
+static void __wcFramePool_spsc_push_back(wc_frame_pool * pool, wc_frame * fr) {
+    uint32_t t = pool->tail;
+    __atomic_store_n(&pool->ring[t % pool->ring_cap], fr, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&pool->total_frames_size, fr->size, __ATOMIC_RELAXED);
+    __atomic_store_n(&pool->tail, t + 1, __ATOMIC_RELEASE);
+}
+
+/* the consumer and the overflowing producer both take the head with CAS.
+ * the producer never writes into the slot at head, so a lost race only
+ * means a retry */
+static wc_frame * __wcFramePool_spsc_pop_front(wc_frame_pool * pool) {
+    uint32_t h = __atomic_load_n(&pool->head, __ATOMIC_ACQUIRE);
+    while (h != __atomic_load_n(&pool->tail, __ATOMIC_ACQUIRE)) {
+        wc_frame * fr = __atomic_load_n(&pool->ring[h % pool->ring_cap], __ATOMIC_RELAXED);
+        if (__atomic_compare_exchange_n(&pool->head, &h, h + 1, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            __atomic_sub_fetch(&pool->total_frames_size, fr->size, __ATOMIC_RELAXED);
+            return fr;
+        }
+    }
+    return NULL;
+}
+
+static void __wcFramePool_raw_push_back(wc_frame_pool * pool, wc_frame * fr) {
     fr->next = NULL;
+    fr->pushed_at = xTaskGetTickCount();
+
+    if (pool->mode == WC_FRAME_POOL_SPSC) {
+        __wcFramePool_spsc_push_back(pool, fr);
+        return;
+    }
 
     pool->frames_cnt++;
     pool->total_frames_size += fr->size;
@@ -70,13 +190,126 @@ void wcFramePool_push_back_nonsafe(wc_frame_pool * pool, wc_frame * fr) {
     if (pool->last_frame) pool->last_frame->next = fr;
     pool->last_frame = fr;
     if (!pool->first_frame) pool->first_frame = fr;
+}
 
-    if ((pool->frames_cnt > pool->cnt_limit) ||
-        (pool->total_frames_size > pool->sz_limit)) {
-        ESP_LOGE(TAG, "limit overflow. frames: %d/%d, size: %d/%d", pool->frames_cnt, pool->cnt_limit,
-                                                                    pool->total_frames_size, pool->sz_limit);
-        wcFramePool_erase_front_nonsafe(pool);
+static wc_frame * __wcFramePool_raw_pop_front(wc_frame_pool * pool) {
+    if (pool->mode == WC_FRAME_POOL_SPSC)
+        return __wcFramePool_spsc_pop_front(pool);
+
+    wc_frame * fr = NULL;
+    if (pool->first_frame) {
+        fr = pool->first_frame;
+        pool->first_frame = fr->next;
+        if (!pool->first_frame) pool->last_frame = NULL;
+        pool->frames_cnt--;
+        pool->total_frames_size -= fr->size;
+    }
+    return fr;
+}
+
+/* the pool is locked. the frame is released by wcFramePool_unlock,
+ * the spsc pool has no lock and releases it at once */
+static void __wcFramePool_erase(wc_frame_pool * pool, wc_frame * fr) {
+    if (pool->mode == WC_FRAME_POOL_SPSC) {
+        if (pool->on_erase_cb)
+            pool->on_erase_cb(pool->on_erase_data, fr);
+        wcFrame_free(fr);
+        return;
     }
+    fr->next = pool->erased;
+    pool->erased = fr;
+}
+
+static void __wcFramePool_drop(wc_frame_pool * pool, wc_frame * fr, uint8_t reason) {
+    __atomic_add_fetch(&pool->drops[reason], 1, __ATOMIC_RELAXED);
+    __wcFramePool_erase(pool, fr);
+}
+
+static inline bool __wcFramePool_expired(wc_frame_pool * pool, wc_frame * fr, TickType_t now) {
+    return (now - fr->pushed_at) > pool->max_age;
+}
+
+static inline bool __wcFramePool_overflow(wc_frame_pool * pool, int16_t add_cnt, int32_t add_size) {
+    return ((wcFramePool_frames_cnt(pool) + add_cnt) > pool->cnt_limit) ||
+           ((wcFramePool_frames_size(pool) + add_size) > pool->sz_limit);
+}
+
+void wcFramePool_set_drop_policy(wc_frame_pool * pool, uint8_t policy, uint32_t max_age_ms) {
+    if (!pool) return;
+    if (wcFramePool_lock(pool)) {
+        pool->drop_policy = policy;
+        pool->max_age = pdMS_TO_TICKS(max_age_ms);
+        wcFramePool_unlock(pool);
+    }
+}
+
+uint32_t wcFramePool_get_drops(wc_frame_pool * pool, uint8_t reason) {
+    if (!pool || (reason >= WC_FRAME_DROP_POLICIES_CNT)) return 0;
+    return __atomic_load_n(&pool->drops[reason], __ATOMIC_RELAXED);
+}
+
+void wcFramePool_push_back_nonsafe(wc_frame_pool * pool, wc_frame * fr) {
+    if ((pool->drop_policy == WC_FRAME_DROP_NEWEST) &&
+         __wcFramePool_overflow(pool, 1, fr->size)) {
+        __wcFramePool_drop(pool, fr, WC_FRAME_DROP_NEWEST);
+        return;
+    }
+
+    if (fr->flags & WC_FRAME_FLAG_KEYFRAME) {
+        __atomic_store_n(&pool->key_flagged, true, __ATOMIC_RELAXED);
+        pool->key_wait = false;
+    } else
+    if ((pool->drop_policy == WC_FRAME_DROP_UNTIL_KEYFRAME) && pool->key_wait) {
+        /* the frame depends on the dropped ones - it would be dropped on pop */
+        __wcFramePool_drop(pool, fr, WC_FRAME_DROP_UNTIL_KEYFRAME);
+        return;
+    }
+
+    __wcFramePool_raw_push_back(pool, fr);
+
+    /* the frames of the spsc ring can be inspected by the consumer only.
+     * the producer drops them unconditionally, the rest is done on pop */
+    bool locked = (pool->mode != WC_FRAME_POOL_SPSC);
+
+    if (locked && (pool->drop_policy == WC_FRAME_DROP_EXPIRED)) {
+        TickType_t now = xTaskGetTickCount();
+        while (pool->first_frame && (pool->first_frame != fr) &&
+               __wcFramePool_expired(pool, pool->first_frame, now)) {
+            __wcFramePool_drop(pool, __wcFramePool_raw_pop_front(pool), WC_FRAME_DROP_EXPIRED);
+        }
+    }
+
+    if (__wcFramePool_overflow(pool, 0, 0)) {
+        ESP_LOGE(TAG, "limit overflow. frames: %d/%d, size: %d/%d", wcFramePool_frames_cnt(pool), pool->cnt_limit,
+                                                                    wcFramePool_frames_size(pool), pool->sz_limit);
+        wc_frame * dropped = __wcFramePool_raw_pop_front(pool);
+        if (dropped) {
+            if ((pool->drop_policy == WC_FRAME_DROP_UNTIL_KEYFRAME) &&
+                __atomic_load_n(&pool->key_flagged, __ATOMIC_RELAXED)) {
+                __wcFramePool_drop(pool, dropped, WC_FRAME_DROP_UNTIL_KEYFRAME);
+                /* frames up to the next keyframe depend on the dropped one.
+                 * the pushed frame is kept - it may start the new sequence */
+                __atomic_add_fetch(&pool->key_drop_gen, 1, __ATOMIC_RELEASE);
+                if ((fr->flags & WC_FRAME_FLAG_KEYFRAME) == 0)
+                    pool->key_wait = true;
+                if (locked) {
+                    while (pool->first_frame && (pool->first_frame != fr) &&
+                           ((pool->first_frame->flags & WC_FRAME_FLAG_KEYFRAME) == 0)) {
+                        __wcFramePool_drop(pool, __wcFramePool_raw_pop_front(pool), WC_FRAME_DROP_UNTIL_KEYFRAME);
+                    }
+                }
+            } else
+            if (pool->drop_policy == WC_FRAME_DROP_EXPIRED) {
+                __wcFramePool_drop(pool, dropped, WC_FRAME_DROP_EXPIRED);
+            } else {
+                if ((pool->drop_policy == WC_FRAME_DROP_UNTIL_KEYFRAME) &&
+                    (__atomic_load_n(&pool->drops[WC_FRAME_DROP_OLDEST], __ATOMIC_RELAXED) == 0))
+                    ESP_LOGW(TAG, "no keyframes are flagged. the oldest frames are dropped");
+                __wcFramePool_drop(pool, dropped, WC_FRAME_DROP_OLDEST);
+            }
+        }
+    }
+    xSemaphoreGive(pool->avail);
 }
 
 wc_frame * wcFramePool_pop_front(wc_frame_pool * pool) {
@@ -90,40 +323,79 @@ wc_frame * wcFramePool_pop_front(wc_frame_pool * pool) {
 }
 
 wc_frame * wcFramePool_pop_front_nonsafe(wc_frame_pool * pool) {
-    wc_frame * fr = NULL;
-    if (pool->first_frame) {
-        fr = pool->first_frame;
-        pool->first_frame = fr->next;
-        if (!pool->first_frame) pool->last_frame = NULL;
-        pool->frames_cnt--;
-        pool->total_frames_size -= fr->size;
+    while (true) {
+        uint32_t gen = __atomic_load_n(&pool->key_drop_gen, __ATOMIC_ACQUIRE);
+        wc_frame * fr = __wcFramePool_raw_pop_front(pool);
+        if (fr == NULL) return NULL;
+
+        if (pool->drop_policy == WC_FRAME_DROP_UNTIL_KEYFRAME) {
+            if (gen != pool->key_seen_gen) {
+                if ((fr->flags & WC_FRAME_FLAG_KEYFRAME) == 0) {
+                    __wcFramePool_drop(pool, fr, WC_FRAME_DROP_UNTIL_KEYFRAME);
+                    continue;
+                }
+                pool->key_seen_gen = gen;
+            }
+        } else
+        if (pool->drop_policy == WC_FRAME_DROP_EXPIRED) {
+            if (__wcFramePool_expired(pool, fr, xTaskGetTickCount())) {
+                __wcFramePool_drop(pool, fr, WC_FRAME_DROP_EXPIRED);
+                continue;
+            }
+        }
+        return fr;
+    }
+}
+
+wc_frame * wcFramePool_pop_front_wait(wc_frame_pool * pool, TickType_t timeout) {
+    if (!pool) return NULL;
+    TickType_t start = xTaskGetTickCount();
+    while (true) {
+        /* pop first - the signal is binary and may be consumed already */
+        wc_frame * fr = wcFramePool_pop_front(pool);
+        if (fr) return fr;
+
+        TickType_t left = portMAX_DELAY;
+        if (timeout != portMAX_DELAY) {
+            TickType_t passed = xTaskGetTickCount() - start;
+            if (passed >= timeout) return NULL;
+            left = timeout - passed;
+        }
+        if (xSemaphoreTake(pool->avail, left) != pdTRUE) return NULL;
     }
-    return fr;
+}
+
+int wcFramePool_drain(wc_frame_pool * pool, wc_frame ** out, int max) {
+    if (!pool) return 0;
+    int cnt = 0;
+    if (wcFramePool_lock(pool)) {
+        while (cnt < max) {
+            wc_frame * fr = wcFramePool_pop_front_nonsafe(pool);
+            if (!fr) break;
+            out[cnt++] = fr;
+        }
+        wcFramePool_unlock(pool);
+    }
+    return cnt;
 }
 
 void wcFramePool_erase_front(wc_frame_pool * pool) {
-    if (!pool) return;
-    wc_frame * fr = wcFramePool_pop_front(pool);
-    if (fr) {
-        if (pool->on_erase_cb)
-            pool->on_erase_cb(pool->on_erase_data, fr);
-        wcFrame_free(fr);
+    if (wcFramePool_lock(pool)) {
+        wcFramePool_erase_front_nonsafe(pool);
+        wcFramePool_unlock(pool);
     }
 }
 
 void wcFramePool_erase_front_nonsafe(wc_frame_pool * pool) {
     if (!pool) return;
-    wc_frame * fr = wcFramePool_pop_front_nonsafe(pool);
-    if (fr) {
-        if (pool->on_erase_cb)
-            pool->on_erase_cb(pool->on_erase_data, fr);
-        wcFrame_free(fr);
-    }
+    wc_frame * fr = __wcFramePool_raw_pop_front(pool);
+    if (fr)
+        __wcFramePool_erase(pool, fr);
 }
 
 void wcFramePool_clear(wc_frame_pool * pool) {
     if (wcFramePool_lock(pool)) {
-        while (pool->frames_cnt > 0) {
+        while (wcFramePool_frames_cnt(pool) > 0) {
             wcFramePool_erase_front_nonsafe(pool);
         }
         wcFramePool_unlock(pool);
@@ -135,17 +407,439 @@ void wcFramePool_free(wc_frame_pool * pool) {
     wcFramePool_clear(pool);
     if (pool->mux)
       vSemaphoreDelete(pool->mux);
+    if (pool->ring)
+      free(pool->ring);
+    if (pool->avail)
+      vSemaphoreDelete(pool->avail);
+    /* frames still held by consumers keep the allocator alive */
+    wcFrameAlloc_free(pool->alloc);
     free(pool);
 }
 
+static void __wcFrame_init_header(wc_frame * fr, int32_t capacity, wc_frame_alloc * alloc) {
+    fr->next = NULL;
+    fr->size = 0;
+    fr->pos = 0;
+    fr->cap = capacity;
+    fr->flags = 0;
+    fr->seq = 0;
+    fr->stamp = 0;
+    fr->hdr_ver = 0;
+    fr->pushed_at = 0;
+    fr->refs = 1;
+    fr->parent = NULL;
+    fr->alloc = alloc;
+    fr->slab = -1;
+    fr->data = NULL;
+    fr->segs = NULL;
+    fr->last_seg = NULL;
+    fr->seg_size = 0;
+    fr->cur_seg = NULL;
+    fr->cur_seg_base = 0;
+}
+
+static wc_frame * __wcFrame_new(wc_frame_alloc * alloc, int32_t seg_size, int32_t capacity) {
+    /* large frames are chained from segments - no contiguous block is needed */
+    if ((seg_size > 0) && (capacity > seg_size)) {
+        wc_frame * fr = alloc ? wcFrameAlloc_frame_segmented(alloc, seg_size) :
+                                wcFrame_init_segmented(seg_size);
+        if (fr) wcFrame_reserve(fr, capacity);
+        return fr;
+    }
+    if (alloc)
+        return wcFrameAlloc_frame(alloc, capacity);
+    return wcFrame_init_cap(capacity);
+}
+
+/* wcFrameFanout */
+
+wc_frame_fanout * wcFrameFanout_init(int16_t max_subscribers,
+                                     const wc_frame_alloc_class * classes, int16_t classes_cnt) {
+    wc_frame_fanout * res = malloc(sizeof(wc_frame_fanout));
+    if (res == NULL) return NULL;
+    memset(res, 0, sizeof(wc_frame_fanout));
+
+    res->subs = malloc(sizeof(wc_frame_pool *) * max_subscribers);
+    if (res->subs == NULL) goto error_no_memory;
+    res->subs_max = max_subscribers;
+
+    res->mux = xSemaphoreCreateMutex();
+    if (res->mux == NULL) goto error_no_memory;
+
+    if (classes && (classes_cnt > 0)) {
+        res->alloc = __wcFrameAlloc_init(classes, classes_cnt, max_subscribers + 1);
+        if (res->alloc == NULL) goto error_no_memory;
+    }
+
+    return res;
+
+error_no_memory:
+    if (res->mux) vSemaphoreDelete(res->mux);
+    if (res->subs) free(res->subs);
+    free(res);
+    return NULL;
+}
+
+wc_frame * wcFrameFanout_new_frame(wc_frame_fanout * fanout, int32_t capacity) {
+    if (!fanout) return wcFrame_init_cap(capacity);
+    return __wcFrame_new(fanout->alloc, fanout->seg_size, capacity);
+}
+
+void wcFrameFanout_set_segmented(wc_frame_fanout * fanout, int32_t seg_size) {
+    if (!fanout) return;
+    fanout->seg_size = seg_size;
+}
+
+bool wcFrameFanout_subscribe(wc_frame_fanout * fanout, wc_frame_pool * pool) {
+    if (!fanout || !pool) return false;
+    bool res = false;
+    if (xSemaphoreTake(fanout->mux, portMAX_DELAY) == pdTRUE) {
+        if (fanout->subs_cnt < fanout->subs_max) {
+            fanout->subs[fanout->subs_cnt++] = pool;
+            res = true;
+        }
+        xSemaphoreGive(fanout->mux);
+    }
+    return res;
+}
+
+void wcFrameFanout_unsubscribe(wc_frame_fanout * fanout, wc_frame_pool * pool) {
+    if (!fanout) return;
+    if (xSemaphoreTake(fanout->mux, portMAX_DELAY) == pdTRUE) {
+        for (int i = 0; i < fanout->subs_cnt; i++) {
+            if (fanout->subs[i] == pool) {
+                fanout->subs_cnt--;
+                memmove(&(fanout->subs[i]), &(fanout->subs[i + 1]),
+                        sizeof(wc_frame_pool *) * (fanout->subs_cnt - i));
+                break;
+            }
+        }
+        xSemaphoreGive(fanout->mux);
+    }
+}
+
+uint8_t wcFrameFanout_fill(wc_frame_fanout * fanout) {
+    uint8_t res = 0;
+    if (fanout && (xSemaphoreTake(fanout->mux, portMAX_DELAY) == pdTRUE)) {
+        for (int i = 0; i < fanout->subs_cnt; i++) {
+            uint8_t fill = wcFramePool_fill(fanout->subs[i]);
+            if (fill > res) res = fill;
+        }
+        xSemaphoreGive(fanout->mux);
+    }
+    return res;
+}
+
+void wcFrameFanout_push(wc_frame_fanout * fanout, wc_frame * fr) {
+    if (!fr) return;
+    if (fanout && (xSemaphoreTake(fanout->mux, portMAX_DELAY) == pdTRUE)) {
+        /* every subscriber gets its own read cursor over the same data */
+        for (int i = 0; i < fanout->subs_cnt; i++) {
+            wc_frame * view = wcFrame_view(fr);
+            if (view)
+                wcFramePool_push_back(fanout->subs[i], view);
+            else
+                ESP_LOGE(TAG, "no memory for a frame view");
+        }
+        xSemaphoreGive(fanout->mux);
+    }
+    wcFrame_free(fr);
+}
+
+void wcFrameFanout_free(wc_frame_fanout * fanout) {
+    if (!fanout) return;
+    if (fanout->mux)
+        vSemaphoreDelete(fanout->mux);
+    if (fanout->subs)
+        free(fanout->subs);
+    wcFrameAlloc_free(fanout->alloc);
+    free(fanout);
+}
+
+/* wcFrameAlloc */
+
+static void __wcFrameAlloc_destroy(wc_frame_alloc * alloc) {
+    for (int i = 0; i < alloc->slabs_cnt; i++) {
+        void * buf = alloc->slabs[i].free_bufs;
+        while (buf) {
+            void * next = *((void **)buf);
+            free(buf);
+            buf = next;
+        }
+    }
+    free(alloc->slabs);
+    free(alloc->frames);
+    free(alloc);
+}
+
+static wc_frame_alloc * __wcFrameAlloc_init(const wc_frame_alloc_class * classes, int16_t classes_cnt,
+                                            int16_t headers_per_buf) {
+    wc_frame_alloc * res = malloc(sizeof(wc_frame_alloc));
+    if (res == NULL) return NULL;
+    memset(res, 0, sizeof(wc_frame_alloc));
+    vPortCPUInitializeMutex(&res->mux);
+
+    res->slabs = malloc(sizeof(wc_frame_slab) * classes_cnt);
+    if (res->slabs == NULL) goto error_no_memory;
+
+    int32_t frames_cnt = 0;
+    for (int i = 0; i < classes_cnt; i++) {
+        /* keep the classes sorted by buffer size - the first fit is the best fit */
+        int j = res->slabs_cnt;
+        while ((j > 0) && (res->slabs[j - 1].buf_size > classes[i].buf_size)) {
+            res->slabs[j] = res->slabs[j - 1];
+            j--;
+        }
+        wc_frame_slab * slab = &(res->slabs[j]);
+        slab->buf_size = classes[i].buf_size;
+        if (slab->buf_size < (int32_t)sizeof(void *)) slab->buf_size = sizeof(void *);
+        slab->count = classes[i].count;
+        slab->free_cnt = 0;
+        slab->free_bufs = NULL;
+        res->slabs_cnt++;
+        frames_cnt += classes[i].count;
+    }
+    /* each slab buffer is a separate block - no large contiguous regions are needed */
+    for (int i = 0; i < res->slabs_cnt; i++) {
+        wc_frame_slab * slab = &(res->slabs[i]);
+        while (slab->free_cnt < slab->count) {
+            void * buf = malloc(slab->buf_size);
+            if (buf == NULL) goto error_no_memory;
+            *((void **)buf) = slab->free_bufs;
+            slab->free_bufs = buf;
+            slab->free_cnt++;
+        }
+    }
+
+    /* shared frames need a header per view */
+    frames_cnt *= headers_per_buf;
+    if (frames_cnt > 0) {
+        res->frames = malloc(sizeof(wc_frame) * frames_cnt);
+        if (res->frames == NULL) goto error_no_memory;
+        res->frames_cnt = frames_cnt;
+        for (int i = frames_cnt - 1; i >= 0; i--) {
+            res->frames[i].next = res->free_frames;
+            res->free_frames = &(res->frames[i]);
+        }
+    }
+
+    return res;
+
+error_no_memory:
+    __wcFrameAlloc_destroy(res);
+    return NULL;
+}
+
+wc_frame_alloc * wcFrameAlloc_init(const wc_frame_alloc_class * classes, int16_t classes_cnt) {
+    return __wcFrameAlloc_init(classes, classes_cnt, 1);
+}
+
+static unsigned char * __wcFrameAlloc_get_buf(wc_frame_alloc * alloc, int32_t size, int16_t * slab_id) {
+    unsigned char * buf = NULL;
+    portENTER_CRITICAL(&alloc->mux);
+    for (int i = 0; i < alloc->slabs_cnt; i++) {
+        wc_frame_slab * slab = &(alloc->slabs[i]);
+        if ((slab->buf_size >= size) && (slab->free_bufs)) {
+            buf = slab->free_bufs;
+            slab->free_bufs = *((void **)buf);
+            slab->free_cnt--;
+            alloc->stats.slab_allocs++;
+            *slab_id = i;
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&alloc->mux);
+
+    if (buf == NULL) {
+        buf = malloc(size);
+        *slab_id = -1;
+        if (buf) {
+            portENTER_CRITICAL(&alloc->mux);
+            alloc->stats.heap_allocs++;
+            portEXIT_CRITICAL(&alloc->mux);
+        }
+    }
+    return buf;
+}
+
+/* usable size of the buffer got for size bytes */
+static inline int32_t __wcFrameAlloc_buf_cap(wc_frame_alloc * alloc, int16_t slab_id, int32_t size) {
+    return (slab_id >= 0) ? alloc->slabs[slab_id].buf_size : size;
+}
+
+static void __wcFrameAlloc_put_buf(wc_frame_alloc * alloc, unsigned char * buf, int16_t slab_id) {
+    if (buf == NULL) return;
+    if (slab_id >= 0) {
+        portENTER_CRITICAL(&alloc->mux);
+        wc_frame_slab * slab = &(alloc->slabs[slab_id]);
+        *((void **)buf) = slab->free_bufs;
+        slab->free_bufs = buf;
+        slab->free_cnt++;
+        alloc->stats.slab_frees++;
+        portEXIT_CRITICAL(&alloc->mux);
+    } else {
+        portENTER_CRITICAL(&alloc->mux);
+        alloc->stats.heap_frees++;
+        portEXIT_CRITICAL(&alloc->mux);
+        free(buf);
+    }
+}
+
+static inline bool __wcFrameAlloc_own_header(wc_frame_alloc * alloc, wc_frame * frm) {
+    return (frm >= alloc->frames) && (frm < (alloc->frames + alloc->frames_cnt));
+}
+
+static wc_frame * __wcFrameAlloc_get_header(wc_frame_alloc * alloc) {
+    wc_frame * fr = NULL;
+    portENTER_CRITICAL(&alloc->mux);
+    if (alloc->free_frames) {
+        fr = alloc->free_frames;
+        alloc->free_frames = fr->next;
+    }
+    alloc->outstanding++;
+    portEXIT_CRITICAL(&alloc->mux);
+
+    if (fr == NULL) {
+        fr = malloc(sizeof(wc_frame));
+        portENTER_CRITICAL(&alloc->mux);
+        if (fr)
+            alloc->stats.heap_allocs++;
+        else
+            alloc->outstanding--;
+        portEXIT_CRITICAL(&alloc->mux);
+    }
+    return fr;
+}
+
+static void __wcFrameAlloc_put_header(wc_frame_alloc * alloc, wc_frame * frm) {
+    bool destroy;
+    portENTER_CRITICAL(&alloc->mux);
+    if (__wcFrameAlloc_own_header(alloc, frm)) {
+        frm->next = alloc->free_frames;
+        alloc->free_frames = frm;
+        frm = NULL;
+    } else
+        alloc->stats.heap_frees++;
+    alloc->outstanding--;
+    destroy = alloc->released && (alloc->outstanding == 0);
+    portEXIT_CRITICAL(&alloc->mux);
+
+    if (frm) free(frm);
+    if (destroy) __wcFrameAlloc_destroy(alloc);
+}
+
+wc_frame * wcFrameAlloc_frame(wc_frame_alloc * alloc, int32_t capacity) {
+    if (!alloc) return wcFrame_init_cap(capacity);
+
+    wc_frame * fr = __wcFrameAlloc_get_header(alloc);
+    if (fr == NULL) return NULL;
+
+    __wcFrame_init_header(fr, capacity, alloc);
+    fr->data = __wcFrameAlloc_get_buf(alloc, capacity, &(fr->slab));
+    if (fr->data == NULL) {
+        wcFrame_free(fr);
+        return NULL;
+    }
+    /* the spare space of the slab buffer is used by the writes */
+    fr->cap = __wcFrameAlloc_buf_cap(alloc, fr->slab, capacity);
+    return fr;
+}
+
+wc_frame * wcFrameAlloc_frame_segmented(wc_frame_alloc * alloc, int32_t seg_size) {
+    if (!alloc) return wcFrame_init_segmented(seg_size);
+
+    wc_frame * fr = __wcFrameAlloc_get_header(alloc);
+    if (fr == NULL) return NULL;
+
+    __wcFrame_init_header(fr, 0, alloc);
+    fr->seg_size = seg_size;
+    return fr;
+}
+
+void wcFrameAlloc_get_stats(wc_frame_alloc * alloc, wc_frame_alloc_stats * stats) {
+    if (!alloc) {
+        memset(stats, 0, sizeof(wc_frame_alloc_stats));
+        return;
+    }
+    portENTER_CRITICAL(&alloc->mux);
+    *stats = alloc->stats;
+    portEXIT_CRITICAL(&alloc->mux);
+}
+
+void wcFrameAlloc_free(wc_frame_alloc * alloc) {
+    if (!alloc) return;
+    bool destroy;
+    portENTER_CRITICAL(&alloc->mux);
+    alloc->released = true;
+    destroy = (alloc->outstanding == 0);
+    portEXIT_CRITICAL(&alloc->mux);
+    if (destroy) __wcFrameAlloc_destroy(alloc);
+}
+
 /* wcFrame */
 
+static void __wcFrame_free_segs(wc_frame * frm) {
+    wc_frame_seg * seg = frm->segs;
+    while (seg) {
+        wc_frame_seg * next = seg->next;
+        if (frm->alloc)
+            __wcFrameAlloc_put_buf(frm->alloc, (unsigned char *)seg, seg->slab);
+        else
+            free(seg);
+        seg = next;
+    }
+    frm->segs = NULL;
+    frm->last_seg = NULL;
+}
+
 void wcFrame_free(wc_frame * frm) {
     if (!frm) return;
-    if (frm->data)
-        free(frm->data);
+    /* shared frames are released with the last reference */
+    if (__atomic_sub_fetch(&frm->refs, 1, __ATOMIC_ACQ_REL) > 0) return;
+
+    wc_frame * parent = frm->parent;
+    if (!parent) __wcFrame_free_segs(frm);
+    if (frm->alloc) {
+        if (!parent)
+            __wcFrameAlloc_put_buf(frm->alloc, frm->data, frm->slab);
+        __wcFrameAlloc_put_header(frm->alloc, frm);
+    } else {
+        if (!parent && frm->data)
+            free(frm->data);
+        free(frm);
+    }
+    /* a view holds a reference to the frame it shares */
+    if (parent) wcFrame_free(parent);
+}
+
+wc_frame * wcFrame_ref(wc_frame * frm) {
+    if (!frm) return NULL;
+    __atomic_add_fetch(&frm->refs, 1, __ATOMIC_RELAXED);
+    return frm;
+}
+
+wc_frame * wcFrame_view(wc_frame * frm) {
+    if (!frm) return NULL;
+    wc_frame * root = frm->parent ? frm->parent : frm;
 
-    free(frm);
+    wc_frame * fr;
+    if (root->alloc)
+        fr = __wcFrameAlloc_get_header(root->alloc);
+    else
+        fr = malloc(sizeof(wc_frame));
+    if (fr == NULL) return NULL;
+
+    __wcFrame_init_header(fr, frm->size, root->alloc);
+    fr->size = frm->size;
+    fr->flags = frm->flags;
+    fr->seq = frm->seq;
+    fr->stamp = frm->stamp;
+    fr->hdr_ver = frm->hdr_ver;
+    fr->parent = wcFrame_ref(root);
+    fr->data = root->data;
+    fr->segs = root->segs;
+    fr->seg_size = root->seg_size;
+    return fr;
 }
 
 void wcFrame_clear(wc_frame * frm) {
@@ -162,40 +856,200 @@ wc_frame * wcFrame_init_cap(int capacity) {
     wc_frame * fr = malloc(sizeof(wc_frame));
     if (fr == NULL) return NULL;
 
-    fr->size = 0;
-    fr->pos = 0;
-    fr->cap = capacity;
+    __wcFrame_init_header(fr, capacity, NULL);
     fr->data = malloc(fr->cap);
     return fr;
 }
 
+wc_frame * wcFrame_init_segmented(int32_t seg_size) {
+    wc_frame * fr = malloc(sizeof(wc_frame));
+    if (fr == NULL) return NULL;
+
+    __wcFrame_init_header(fr, 0, NULL);
+    fr->seg_size = seg_size;
+    return fr;
+}
+
+bool wcFrame_is_segmented(wc_frame * fr) {
+    return (fr->seg_size > 0);
+}
+
+static inline unsigned char * __wcFrame_seg_data(wc_frame_seg * seg) {
+    return (unsigned char *)(seg + 1);
+}
+
+/* finds the segment holding pos. sequential access starts from the cached one */
+static wc_frame_seg * __wcFrame_locate(wc_frame * fr, int32_t pos, int32_t * off) {
+    wc_frame_seg * seg = fr->segs;
+    int32_t base = 0;
+    if (fr->cur_seg && (pos >= fr->cur_seg_base)) {
+        seg = fr->cur_seg;
+        base = fr->cur_seg_base;
+    }
+    while (seg && (pos >= (base + fr->seg_size))) {
+        seg = seg->next;
+        base += fr->seg_size;
+    }
+    if (seg) {
+        fr->cur_seg = seg;
+        fr->cur_seg_base = base;
+    }
+    *off = pos - base;
+    return seg;
+}
+
+static void __wcFrame_copy_out(wc_frame * fr, int32_t pos, void * buf, int32_t sz) {
+    if (!wcFrame_is_segmented(fr)) {
+        memcpy(buf, fr->data + pos, sz);
+        return;
+    }
+    int32_t off;
+    wc_frame_seg * seg = __wcFrame_locate(fr, pos, &off);
+    while (seg && (sz > 0)) {
+        int32_t len = fr->seg_size - off;
+        if (len > sz) len = sz;
+        memcpy(buf, __wcFrame_seg_data(seg) + off, len);
+        buf = (unsigned char *)buf + len;
+        sz -= len;
+        off = 0;
+        seg = seg->next;
+    }
+}
+
+static void __wcFrame_copy_in(wc_frame * fr, int32_t pos, const void * buf, int32_t sz) {
+    if (!wcFrame_is_segmented(fr)) {
+        memcpy(fr->data + pos, buf, sz);
+        return;
+    }
+    int32_t off;
+    wc_frame_seg * seg = __wcFrame_locate(fr, pos, &off);
+    while (seg && (sz > 0)) {
+        int32_t len = fr->seg_size - off;
+        if (len > sz) len = sz;
+        memcpy(__wcFrame_seg_data(seg) + off, buf, len);
+        buf = (const unsigned char *)buf + len;
+        sz -= len;
+        off = 0;
+        seg = seg->next;
+    }
+}
+
+bool wcFrame_reserve(wc_frame * fr, int32_t capacity) {
+    if (!wcFrame_is_segmented(fr)) return (fr->cap >= capacity);
+    while (fr->cap < capacity) {
+        int32_t blk_size = sizeof(wc_frame_seg) + fr->seg_size;
+        wc_frame_seg * seg;
+        int16_t slab_id = -1;
+        if (fr->alloc)
+            seg = (wc_frame_seg *)__wcFrameAlloc_get_buf(fr->alloc, blk_size, &slab_id);
+        else
+            seg = malloc(blk_size);
+        if (seg == NULL) return false;
+        seg->next = NULL;
+        seg->slab = slab_id;
+        if (fr->last_seg) fr->last_seg->next = seg;
+        else fr->segs = seg;
+        fr->last_seg = seg;
+        fr->cap += fr->seg_size;
+    }
+    return true;
+}
+
+int wcFrame_get_iov(wc_frame * fr, int32_t offset, wc_frame_iovec * iov, int max_iov) {
+    if ((offset >= fr->size) || (max_iov <= 0)) return 0;
+    if (!wcFrame_is_segmented(fr)) {
+        iov[0].base = fr->data + offset;
+        iov[0].len = fr->size - offset;
+        return 1;
+    }
+    int cnt = 0;
+    int32_t off;
+    int32_t left = fr->size - offset;
+    wc_frame_seg * seg = __wcFrame_locate(fr, offset, &off);
+    while (seg && (left > 0) && (cnt < max_iov)) {
+        int32_t len = fr->seg_size - off;
+        if (len > left) len = left;
+        iov[cnt].base = __wcFrame_seg_data(seg) + off;
+        iov[cnt].len = len;
+        cnt++;
+        left -= len;
+        off = 0;
+        seg = seg->next;
+    }
+    return cnt;
+}
+
 void wcFrame_writeData(wc_frame * fr, const void * buf, int32_t sz) {
-    if (fr->cap < (fr->size + sz)) {
-        fr->cap = ((fr->size + sz) / 0x400 + 1) * 0x400;
-        fr->data = realloc(fr->data, fr->cap);
+    if (fr->parent) {
+        ESP_LOGE(TAG, "shared frame is read-only");
+        return;
+    }
+    if (wcFrame_is_segmented(fr)) {
+        if (!wcFrame_reserve(fr, fr->pos + sz)) {
+            ESP_LOGE(TAG, "no memory for a frame segment");
+            return;
+        }
+        __wcFrame_copy_in(fr, fr->pos, buf, sz);
+        fr->pos += sz;
+        if (fr->size < fr->pos) fr->size = fr->pos;
+        return;
+    }
+    if (fr->cap < (fr->pos + sz)) {
+        int32_t cap = ((fr->pos + sz) / 0x400 + 1) * 0x400;
+        unsigned char * data;
+        if (fr->alloc) {
+            /* slab buffers can not be reallocated in place */
+            int16_t slab_id;
+            data = __wcFrameAlloc_get_buf(fr->alloc, cap, &slab_id);
+            if (data) {
+                if (fr->data) memcpy(data, fr->data, fr->size);
+                __wcFrameAlloc_put_buf(fr->alloc, fr->data, fr->slab);
+                fr->slab = slab_id;
+                cap = __wcFrameAlloc_buf_cap(fr->alloc, slab_id, cap);
+            }
+        } else
+            data = realloc(fr->data, cap);
+        if (data == NULL) {
+            /* the frame keeps the old buffer */
+            ESP_LOGE(TAG, "no memory for a frame buffer");
+            return;
+        }
+        fr->data = data;
+        fr->cap = cap;
     }
     memcpy(fr->data + fr->pos, buf, sz);
     fr->pos += sz;
     if (fr->size < fr->pos) fr->size = fr->pos;
 }
 
+/* overwrites the written bytes at pos. the frame is never grown */
+bool wcFrame_writeAt(wc_frame * fr, int32_t pos, const void * buf, int32_t sz) {
+    if (fr->parent) {
+        ESP_LOGE(TAG, "shared frame is read-only");
+        return false;
+    }
+    if ((pos < 0) || (sz < 0) || (pos + sz > fr->size)) return false;
+    __wcFrame_copy_in(fr, pos, buf, sz);
+    return true;
+}
+
 uint8_t wcFrame_readByte(wc_frame * fr) {
     uint8_t res = 0;
-    memcpy(&res, fr->data + fr->pos, 1);
+    __wcFrame_copy_out(fr, fr->pos, &res, 1);
     fr->pos++;
     return res;
 }
 
 uint16_t wcFrame_readWord(wc_frame * fr) {
     uint16_t res = 0;
-    memcpy(&res, fr->data + fr->pos, 2);
+    __wcFrame_copy_out(fr, fr->pos, &res, 2);
     fr->pos += 2;
     return res;
 }
 
 uint32_t wcFrame_readUInt32(wc_frame * fr) {
     uint32_t res = 0;
-    memcpy(&res, fr->data + fr->pos, 4);
+    __wcFrame_copy_out(fr, fr->pos, &res, 4);
     fr->pos += 4;
     return res;
 }
@@ -205,8 +1059,104 @@ int32_t wcFrame_readBuffer(wc_frame * fr, void * buf, int32_t sz) {
         sz = fr->size - fr->pos;
     }
     if (sz > 0) {
-        memcpy(buf, fr->data + fr->pos, sz);
+        __wcFrame_copy_out(fr, fr->pos, buf, sz);
         fr->pos += sz;
     }
     return sz;
 }
+
+/* wcRing */
+
+wc_ring * wcRing_init(int32_t capacity) {
+    wc_ring * ring = malloc(sizeof(wc_ring));
+    if (ring == NULL) return NULL;
+
+    ring->data = malloc(capacity);
+    if (ring->data == NULL) {
+        free(ring);
+        return NULL;
+    }
+    ring->cap = capacity;
+    ring->head = 0;
+    ring->size = 0;
+    return ring;
+}
+
+int32_t wcRing_size(wc_ring * ring) {
+    return ring->size;
+}
+
+int32_t wcRing_free_size(wc_ring * ring) {
+    return ring->cap - ring->size;
+}
+
+int32_t wcRing_write(wc_ring * ring, const void * buf, int32_t sz) {
+    if (sz > wcRing_free_size(ring)) sz = wcRing_free_size(ring);
+    if (sz <= 0) return 0;
+
+    int32_t tail = ring->head + ring->size;
+    if (tail >= ring->cap) tail -= ring->cap;
+    int32_t part = ring->cap - tail;
+    if (part > sz) part = sz;
+    memcpy(ring->data + tail, buf, part);
+    if (part < sz)
+        memcpy(ring->data, (const unsigned char *)buf + part, sz - part);
+    ring->size += sz;
+    return sz;
+}
+
+int32_t wcRing_span(wc_ring * ring, int32_t offset, const unsigned char ** ptr) {
+    if (offset >= ring->size) return 0;
+    int32_t p = ring->head + offset;
+    if (p >= ring->cap) p -= ring->cap;
+    int32_t len = ring->cap - p;
+    if (len > (ring->size - offset)) len = ring->size - offset;
+    *ptr = ring->data + p;
+    return len;
+}
+
+int32_t wcRing_peek(wc_ring * ring, int32_t offset, void * buf, int32_t sz) {
+    int32_t done = 0;
+    while (done < sz) {
+        const unsigned char * src;
+        int32_t len = wcRing_span(ring, offset + done, &src);
+        if (len == 0) break;
+        if (len > (sz - done)) len = sz - done;
+        memcpy((unsigned char *)buf + done, src, len);
+        done += len;
+    }
+    return done;
+}
+
+uint16_t wcRing_peekWord(wc_ring * ring, int32_t offset) {
+    uint16_t res = 0;
+    wcRing_peek(ring, offset, &res, 2);
+    return res;
+}
+
+uint32_t wcRing_peekUInt32(wc_ring * ring, int32_t offset) {
+    uint32_t res = 0;
+    wcRing_peek(ring, offset, &res, 4);
+    return res;
+}
+
+void wcRing_skip(wc_ring * ring, int32_t sz) {
+    if (sz > ring->size) sz = ring->size;
+    ring->size -= sz;
+    ring->head += sz;
+    if (ring->head >= ring->cap) ring->head -= ring->cap;
+    /* rewind when empty - keeps the next data contiguous */
+    if (ring->size == 0) ring->head = 0;
+}
+
+void wcRing_clear(wc_ring * ring) {
+    if (!ring) return;
+    ring->head = 0;
+    ring->size = 0;
+}
+
+void wcRing_free(wc_ring * ring) {
+    if (!ring) return;
+    if (ring->data) free(ring->data);
+    free(ring);
+}
@@ -21,18 +21,113 @@
 
 #define INITIAL_FRAME_BUFFER 0x8000
 
+// wc_frame flags
+#define WC_FRAME_FLAG_KEYFRAME 0x0001  // frame does not depend on the previous ones
+
+struct wc_frame_alloc;
+
+/* segment of a chained frame. the data follows the header */
+typedef struct wc_frame_seg {
+    struct wc_frame_seg * next;
+    int16_t slab;                   // slab class of the segment or -1 if it is on heap
+} wc_frame_seg;
+
+typedef struct wc_frame_iovec {
+    const unsigned char * base;
+    int32_t len;
+} wc_frame_iovec;
+
 typedef struct wc_frame {
     struct wc_frame * next;
     int32_t size;
     int32_t cap;
     int32_t pos;
     unsigned char * data;
+    uint16_t flags;
+    uint32_t seq;                   // sequence number of the stream frame (v2 frame header)
+    uint32_t stamp;                 // capture time in ms (v2 frame header)
+    uint8_t hdr_ver;                // version of the stream header reserved at the data start, 0 - none
+    TickType_t pushed_at;           // tick of the last push into a pool
+    int32_t refs;                   // references to the frame, freed with the last one
+    struct wc_frame * parent;       // shared frame for a read-only view or NULL
+    struct wc_frame_alloc * alloc;  // owner allocator or NULL for heap frames
+    int16_t slab;                   // slab class of data or -1 if data is on heap
+    /* segmented frames keep data in a chain of seg_size segments, data is NULL */
+    wc_frame_seg * segs;
+    wc_frame_seg * last_seg;
+    int32_t seg_size;
+    wc_frame_seg * cur_seg;         // cached segment of the last access
+    int32_t cur_seg_base;
 } wc_frame;
 
+/* recycling frame allocator */
+typedef struct wc_frame_alloc_class {
+    int32_t buf_size;
+    int16_t count;
+} wc_frame_alloc_class;
+
+typedef struct wc_frame_alloc_stats {
+    uint32_t slab_allocs;   // buffers taken from the free lists
+    uint32_t slab_frees;    // buffers returned to the free lists
+    uint32_t heap_allocs;   // fallback malloc calls (no free slab of suitable size)
+    uint32_t heap_frees;    // fallback free calls
+} wc_frame_alloc_stats;
+
+typedef struct wc_frame_slab {
+    int32_t buf_size;
+    int16_t count;
+    int16_t free_cnt;
+    void * free_bufs;       // free buffers are linked through their first word
+} wc_frame_slab;
+
+typedef struct wc_frame_alloc {
+    portMUX_TYPE mux;
+
+    wc_frame_slab * slabs;
+    int16_t slabs_cnt;
+
+    wc_frame * frames;      // preallocated frame headers
+    int16_t frames_cnt;
+    wc_frame * free_frames;
+
+    int32_t outstanding;    // frames given out and not returned yet
+    bool released;
+    wc_frame_alloc_stats stats;
+} wc_frame_alloc;
+
 typedef void (*wc_frame_erase) (void * data, wc_frame * frm);
 
+/* circular byte buffer */
+typedef struct wc_ring {
+    unsigned char * data;
+    int32_t cap;
+    int32_t head;           // read position
+    int32_t size;           // bytes stored
+} wc_ring;
+
+// wc_frame_pool modes
+#define WC_FRAME_POOL_LOCKED 0  // any number of producers and consumers, mutex guarded
+#define WC_FRAME_POOL_SPSC   1  // one producer and one consumer task, lock-free ring
+
+// wc_frame_pool drop policies. also the indices of the drop counters
+#define WC_FRAME_DROP_OLDEST         0  // drop the front frame on overflow
+#define WC_FRAME_DROP_NEWEST         1  // refuse the pushed frame on overflow
+#define WC_FRAME_DROP_UNTIL_KEYFRAME 2  // drop frames on overflow up to the next keyframe.
+                                        // the frames pushed after the drop are refused up to the keyframe.
+                                        // the front frame only until the producer flags a keyframe
+#define WC_FRAME_DROP_EXPIRED        3  // drop frames older than max_age, the front frame on overflow
+#define WC_FRAME_DROP_POLICIES_CNT   4
+
 typedef struct wc_frame_pool {
     SemaphoreHandle_t mux;
+    SemaphoreHandle_t avail;    // signalled on each push_back
+    uint8_t mode;
+
+    /* WC_FRAME_POOL_SPSC ring of frames. frames_cnt is not used in this mode */
+    wc_frame ** ring;
+    uint32_t ring_cap;
+    uint32_t head;
+    uint32_t tail;
 
     wc_frame * first_frame;
     wc_frame * last_frame;
@@ -40,31 +135,104 @@ typedef struct wc_frame_pool {
     int32_t total_frames_size;
     wc_frame_erase on_erase_cb;
     void * on_erase_data;
+    wc_frame * erased;          // passed to on_erase_cb by wcFramePool_unlock
 
     int16_t cnt_limit;
     int32_t sz_limit;
+
+    uint8_t drop_policy;
+    TickType_t max_age;
+    uint32_t key_drop_gen;      // bumped by WC_FRAME_DROP_UNTIL_KEYFRAME drops
+    uint32_t key_seen_gen;      // generation of the last keyframe taken by the consumer
+    bool     key_flagged;       // a keyframe was pushed. the drops up to the next one are possible
+    bool     key_wait;          // a frame was dropped. the pushed frames are refused up to the next keyframe
+    uint32_t drops[WC_FRAME_DROP_POLICIES_CNT];
+
+    wc_frame_alloc * alloc;
+    int32_t seg_size;           // new frames larger than seg_size are segmented, 0 - never
 } wc_frame_pool;
 
 wc_frame_pool * wcFramePool_init(int16_t frames_limit, int32_t frames_size_limit);
+wc_frame_pool * wcFramePool_init_alloc(int16_t frames_limit, int32_t frames_size_limit,
+                                       const wc_frame_alloc_class * classes, int16_t classes_cnt);
+wc_frame_pool * wcFramePool_init_ext(int16_t frames_limit, int32_t frames_size_limit, uint8_t mode,
+                                     const wc_frame_alloc_class * classes, int16_t classes_cnt);
+wc_frame * wcFramePool_new_frame(wc_frame_pool * pool, int32_t capacity);
+void wcFramePool_set_segmented(wc_frame_pool * pool, int32_t seg_size);
+int16_t wcFramePool_frames_cnt(wc_frame_pool * pool);
+int32_t wcFramePool_frames_size(wc_frame_pool * pool);
+/* fill of the pool limits in percent */
+uint8_t wcFramePool_fill(wc_frame_pool * pool);
 bool wcFramePool_lock(wc_frame_pool * pool);
 void wcFramePool_unlock(wc_frame_pool * pool);
+void wcFramePool_set_drop_policy(wc_frame_pool * pool, uint8_t policy, uint32_t max_age_ms);
+uint32_t wcFramePool_get_drops(wc_frame_pool * pool, uint8_t reason);
 void wcFramePool_push_back(wc_frame_pool * pool, wc_frame * fr);
 void wcFramePool_push_back_nonsafe(wc_frame_pool * pool, wc_frame * fr);
 wc_frame * wcFramePool_pop_front(wc_frame_pool * pool);
 wc_frame * wcFramePool_pop_front_nonsafe(wc_frame_pool * pool);
+wc_frame * wcFramePool_pop_front_wait(wc_frame_pool * pool, TickType_t timeout);
+int wcFramePool_drain(wc_frame_pool * pool, wc_frame ** out, int max);
 void wcFramePool_erase_front(wc_frame_pool * pool);
 void wcFramePool_erase_front_nonsafe(wc_frame_pool * pool);
 void wcFramePool_clear(wc_frame_pool * pool);
 void wcFramePool_free(wc_frame_pool * pool);
 
+/* fan-out of the shared frames to subscriber pools */
+typedef struct wc_frame_fanout {
+    SemaphoreHandle_t mux;
+    wc_frame_pool ** subs;
+    int16_t subs_cnt;
+    int16_t subs_max;
+
+    wc_frame_alloc * alloc;
+    int32_t seg_size;
+} wc_frame_fanout;
+
+wc_frame_fanout * wcFrameFanout_init(int16_t max_subscribers,
+                                     const wc_frame_alloc_class * classes, int16_t classes_cnt);
+wc_frame * wcFrameFanout_new_frame(wc_frame_fanout * fanout, int32_t capacity);
+void wcFrameFanout_set_segmented(wc_frame_fanout * fanout, int32_t seg_size);
+bool wcFrameFanout_subscribe(wc_frame_fanout * fanout, wc_frame_pool * pool);
+void wcFrameFanout_unsubscribe(wc_frame_fanout * fanout, wc_frame_pool * pool);
+/* fill of the fullest subscriber in percent */
+uint8_t wcFrameFanout_fill(wc_frame_fanout * fanout);
+void wcFrameFanout_push(wc_frame_fanout * fanout, wc_frame * fr);
+void wcFrameFanout_free(wc_frame_fanout * fanout);
+
 wc_frame * wcFrame_init();
 wc_frame * wcFrame_init_cap(int capacity);
+wc_frame * wcFrame_init_segmented(int32_t seg_size);
+bool wcFrame_is_segmented(wc_frame * fr);
+bool wcFrame_reserve(wc_frame * fr, int32_t capacity);
+int wcFrame_get_iov(wc_frame * fr, int32_t offset, wc_frame_iovec * iov, int max_iov);
 void wcFrame_writeData(wc_frame * fr, const void * buf, int32_t sz);
+bool wcFrame_writeAt(wc_frame * fr, int32_t pos, const void * buf, int32_t sz);
 uint8_t wcFrame_readByte(wc_frame * fr);
 uint16_t wcFrame_readWord(wc_frame * fr);
 uint32_t wcFrame_readUInt32(wc_frame * fr);
 int32_t wcFrame_readBuffer(wc_frame * fr, void * buf, int32_t sz);
 void wcFrame_clear(wc_frame * frm);
 void wcFrame_free(wc_frame * frm);
+wc_frame * wcFrame_ref(wc_frame * frm);
+wc_frame * wcFrame_view(wc_frame * frm);
+
+wc_ring * wcRing_init(int32_t capacity);
+int32_t wcRing_size(wc_ring * ring);
+int32_t wcRing_free_size(wc_ring * ring);
+int32_t wcRing_write(wc_ring * ring, const void * buf, int32_t sz);
+int32_t wcRing_span(wc_ring * ring, int32_t offset, const unsigned char ** ptr);
+int32_t wcRing_peek(wc_ring * ring, int32_t offset, void * buf, int32_t sz);
+uint16_t wcRing_peekWord(wc_ring * ring, int32_t offset);
+uint32_t wcRing_peekUInt32(wc_ring * ring, int32_t offset);
+void wcRing_skip(wc_ring * ring, int32_t sz);
+void wcRing_clear(wc_ring * ring);
+void wcRing_free(wc_ring * ring);
+
+wc_frame_alloc * wcFrameAlloc_init(const wc_frame_alloc_class * classes, int16_t classes_cnt);
+wc_frame * wcFrameAlloc_frame(wc_frame_alloc * alloc, int32_t capacity);
+wc_frame * wcFrameAlloc_frame_segmented(wc_frame_alloc * alloc, int32_t seg_size);
+void wcFrameAlloc_get_stats(wc_frame_alloc * alloc, wc_frame_alloc_stats * stats);
+void wcFrameAlloc_free(wc_frame_alloc * alloc);
 
 #endif
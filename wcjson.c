@@ -0,0 +1,423 @@
+// Copyright 2023 Medvedkov Ilya
+//
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdio.h>
+#include <math.h>
+#include <float.h>
+#include <limits.h>
+#include <ctype.h>
+
+#include "wcjson.h"
+
+// writer phases
+#define WCJ_VALUE  0
+#define WCJ_KEY    1
+#define WCJ_STR    2
+#define WCJ_NEXT   3
+#define WCJ_DONE   4
+#define WCJ_ERROR  5
+
+static void __wcjson_pend(wc_json_writer * w, const char * s) {
+    size_t l = strlen(s);
+    memcpy(w->pend, s, l);
+    w->pend_len = l;
+    w->pend_pos = 0;
+}
+
+static void __wcjson_pend_chr(wc_json_writer * w, char c) {
+    w->pend[0] = c;
+    w->pend_len = 1;
+    w->pend_pos = 0;
+}
+
+static inline bool __wcjson_need_escape(unsigned char c) {
+    return (c < 32) || (c == '\"') || (c == '\\');
+}
+
+static void __wcjson_escape(wc_json_writer * w, unsigned char c) {
+    switch (c) {
+        case '\"': __wcjson_pend(w, "\\\""); break;
+        case '\\': __wcjson_pend(w, "\\\\"); break;
+        case '\b': __wcjson_pend(w, "\\b"); break;
+        case '\f': __wcjson_pend(w, "\\f"); break;
+        case '\n': __wcjson_pend(w, "\\n"); break;
+        case '\r': __wcjson_pend(w, "\\r"); break;
+        case '\t': __wcjson_pend(w, "\\t"); break;
+        default:
+            w->pend_len = snprintf(w->pend, WC_JSON_PEND_SIZE, "\\u%04x", c);
+            w->pend_pos = 0;
+            break;
+    }
+}
+
+/* the same form as cJSON prints */
+static void __wcjson_number(wc_json_writer * w, const cJSON * item) {
+    double d = item->valuedouble;
+    int l;
+    if (isnan(d) || isinf(d)) {
+        l = snprintf(w->pend, WC_JSON_PEND_SIZE, "null");
+    } else
+    if (d == (double) item->valueint) {
+        l = snprintf(w->pend, WC_JSON_PEND_SIZE, "%d", item->valueint);
+    } else {
+        double test = 0.0;
+        l = snprintf(w->pend, WC_JSON_PEND_SIZE, "%1.15g", d);
+        if ((sscanf(w->pend, "%lg", &test) != 1) ||
+            (fabs(test - d) > fmax(fabs(test), fabs(d)) * DBL_EPSILON))
+            l = snprintf(w->pend, WC_JSON_PEND_SIZE, "%1.17g", d);
+    }
+    w->pend_len = l;
+    w->pend_pos = 0;
+}
+
+static void __wcjson_str_start(wc_json_writer * w, const char * s, bool is_key) {
+    w->str = s ? s : "";
+    w->str_pos = 0;
+    w->is_key = is_key;
+    w->is_raw = false;
+    w->phase = WCJ_STR;
+    __wcjson_pend_chr(w, '\"');
+}
+
+static void __wcjson_str_end(wc_json_writer * w) {
+    if (w->is_raw) {
+        w->phase = WCJ_NEXT;
+    } else
+    if (w->is_key) {
+        __wcjson_pend(w, "\":");
+        w->phase = WCJ_VALUE;
+    } else {
+        __wcjson_pend_chr(w, '\"');
+        w->phase = WCJ_NEXT;
+    }
+    w->str = NULL;
+}
+
+static bool __wcjson_is_object(const cJSON * item) {
+    return (item->type & 0xFF) == cJSON_Object;
+}
+
+/* moves the writer to the next piece of the text */
+static void __wcjson_step(wc_json_writer * w) {
+    const cJSON * item = w->cur;
+    switch (w->phase) {
+        case WCJ_VALUE:
+            switch (item->type & 0xFF) {
+                case cJSON_False:
+                    __wcjson_pend(w, "false");
+                    w->phase = WCJ_NEXT;
+                    break;
+                case cJSON_True:
+                    __wcjson_pend(w, "true");
+                    w->phase = WCJ_NEXT;
+                    break;
+                case cJSON_NULL:
+                    __wcjson_pend(w, "null");
+                    w->phase = WCJ_NEXT;
+                    break;
+                case cJSON_Number:
+                    __wcjson_number(w, item);
+                    w->phase = WCJ_NEXT;
+                    break;
+                case cJSON_String:
+                    __wcjson_str_start(w, item->valuestring, false);
+                    break;
+                case cJSON_Raw:
+                    if (item->valuestring == NULL) {
+                        w->phase = WCJ_ERROR;
+                        break;
+                    }
+                    w->str = item->valuestring;
+                    w->str_pos = 0;
+                    w->is_key = false;
+                    w->is_raw = true;
+                    w->phase = WCJ_STR;
+                    break;
+                case cJSON_Array:
+                case cJSON_Object: {
+                    bool is_obj = __wcjson_is_object(item);
+                    if (item->child == NULL) {
+                        __wcjson_pend(w, is_obj ? "{}" : "[]");
+                        w->phase = WCJ_NEXT;
+                        break;
+                    }
+                    if (w->depth >= WC_JSON_MAX_DEPTH) {
+                        w->phase = WCJ_ERROR;
+                        break;
+                    }
+                    w->stack[w->depth++] = item;
+                    w->cur = item->child;
+                    __wcjson_pend_chr(w, is_obj ? '{' : '[');
+                    w->phase = is_obj ? WCJ_KEY : WCJ_VALUE;
+                    break;
+                }
+                default:
+                    w->phase = WCJ_ERROR;
+                    break;
+            }
+            break;
+        case WCJ_KEY:
+            __wcjson_str_start(w, item->string, true);
+            break;
+        case WCJ_NEXT: {
+            if (w->depth == 0) {
+                w->phase = WCJ_DONE;
+                break;
+            }
+            const cJSON * parent = w->stack[w->depth - 1];
+            if (item->next) {
+                w->cur = item->next;
+                __wcjson_pend_chr(w, ',');
+                w->phase = __wcjson_is_object(parent) ? WCJ_KEY : WCJ_VALUE;
+            } else {
+                w->depth--;
+                w->cur = parent;
+                __wcjson_pend_chr(w, __wcjson_is_object(parent) ? '}' : ']');
+            }
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+void wcJsonWriter_init(wc_json_writer * w, const cJSON * root) {
+    memset(w, 0, sizeof(wc_json_writer));
+    w->root = root;
+    w->cur = root;
+    w->phase = root ? WCJ_VALUE : WCJ_ERROR;
+}
+
+int wcJsonWriter_write(wc_json_writer * w, char * buf, int len) {
+    int pos = 0;
+    while (pos < len) {
+        if (w->pend_pos < w->pend_len) {
+            int n = w->pend_len - w->pend_pos;
+            if (n > len - pos) n = len - pos;
+            if (buf) memcpy(&(buf[pos]), &(w->pend[w->pend_pos]), n);
+            w->pend_pos += n;
+            pos += n;
+            continue;
+        }
+        if (w->phase == WCJ_STR) {
+            const char * s = &(w->str[w->str_pos]);
+            if (*s == 0) {
+                __wcjson_str_end(w);
+                continue;
+            }
+            /* the plain runs are copied at once, the escapes go through pend */
+            int n = 0;
+            while (s[n] && (n < len - pos) &&
+                   (w->is_raw || !__wcjson_need_escape((unsigned char) s[n])))
+                n++;
+            if (n > 0) {
+                if (buf) memcpy(&(buf[pos]), s, n);
+                w->str_pos += n;
+                pos += n;
+            } else {
+                __wcjson_escape(w, (unsigned char) *s);
+                w->str_pos++;
+            }
+            continue;
+        }
+        if (w->phase == WCJ_ERROR) return -1;
+        if (w->phase == WCJ_DONE) break;
+        __wcjson_step(w);
+    }
+    return pos;
+}
+
+bool wcJsonWriter_done(wc_json_writer * w) {
+    return (w->phase == WCJ_DONE) && (w->pend_pos == w->pend_len);
+}
+
+int wcJson_measure(const cJSON * root) {
+    wc_json_writer w;
+    wcJsonWriter_init(&w, root);
+    int len = wcJsonWriter_write(&w, NULL, INT_MAX);
+    if ((len < 0) || !wcJsonWriter_done(&w)) return -1;
+    return len;
+}
+
+// splitter sinks
+#define WCJS_REST  0
+#define WCJS_ITEM  1
+#define WCJS_DROP  2
+
+wc_json_splitter * wcJsonSplitter_init(const char * key, size_t item_max,
+                                       wc_json_on_item on_item, wc_json_on_rest on_rest,
+                                       void * user_data) {
+    wc_json_splitter * sp = malloc(sizeof(wc_json_splitter));
+    if (sp == NULL) return NULL;
+    memset(sp, 0, sizeof(wc_json_splitter));
+    sp->key = key;
+    sp->item_max = item_max;
+    sp->on_item = on_item;
+    sp->on_rest = on_rest;
+    sp->user_data = user_data;
+    return sp;
+}
+
+void wcJsonSplitter_free(wc_json_splitter * sp) {
+    if (sp->item) free(sp->item);
+    free(sp);
+}
+
+static bool __wcjs_item_append(wc_json_splitter * sp, const char * data, size_t len) {
+    if (sp->item_over) return true;
+    if (sp->item_len + len > sp->item_max) {
+        sp->item_over = true;
+        return true;
+    }
+    if (sp->item_len + len + 1 > sp->item_size) {
+        size_t sz = ((sp->item_len + len + 1) / 1024 + 1) * 1024;
+        if (sz > sp->item_max + 1) sz = sp->item_max + 1;
+        char * item = realloc(sp->item, sz);
+        if (item == NULL) {
+            sp->item_over = true;
+            return true;
+        }
+        sp->item = item;
+        sp->item_size = sz;
+    }
+    memcpy(&(sp->item[sp->item_len]), data, len);
+    sp->item_len += len;
+    return true;
+}
+
+static bool __wcjs_flush(wc_json_splitter * sp, int sink, const char * data, size_t len) {
+    if (len == 0) return true;
+    if (sink == WCJS_REST)
+        return sp->on_rest ? sp->on_rest(sp->user_data, data, len) : true;
+    if (sink == WCJS_ITEM)
+        return __wcjs_item_append(sp, data, len);
+    return true;
+}
+
+static bool __wcjs_item_end(wc_json_splitter * sp) {
+    bool res = true;
+    sp->in_item = false;
+    if (sp->item_over) {
+        sp->dropped++;
+    } else
+    if (sp->item_len > 0) {
+        /* the spaces before the separator */
+        while ((sp->item_len > 0) && isspace((unsigned char) sp->item[sp->item_len - 1]))
+            sp->item_len--;
+        sp->item[sp->item_len] = 0;
+        sp->items++;
+        if (sp->on_item) res = sp->on_item(sp->user_data, sp->item, sp->item_len);
+    }
+    sp->item_len = 0;
+    sp->item_over = false;
+    return res;
+}
+
+static bool __wcjs_is_key(wc_json_splitter * sp) {
+    return !sp->key_over && (sp->key_len == strlen(sp->key)) &&
+           (strncmp(sp->key_buf, sp->key, sp->key_len) == 0);
+}
+
+bool wcJsonSplitter_feed(wc_json_splitter * sp, const char * data, size_t len) {
+    size_t run = 0;
+    int run_sink = WCJS_REST;
+    for (size_t i = 0; i < len; i++) {
+        char c = data[i];
+        int sink;
+        bool item_end = false;
+        if (sp->in_str) {
+            if (sp->in_esc) {
+                sp->in_esc = false;
+            } else
+            if (c == '\\') {
+                sp->in_esc = true;
+            } else
+            if (c == '\"') {
+                sp->in_str = false;
+                sp->in_key = false;
+            } else
+            if (sp->in_key) {
+                if (sp->key_len < WC_JSON_KEY_SIZE)
+                    sp->key_buf[sp->key_len++] = c;
+                else
+                    sp->key_over = true;
+            }
+            sink = sp->in_item ? WCJS_ITEM : WCJS_REST;
+        } else {
+            bool at_items = sp->in_array && (sp->depth == 2);
+            switch (c) {
+                case '{':
+                case '[':
+                    if (at_items) {
+                        sp->in_item = true;
+                    } else
+                    if ((sp->depth == 1) && (c == '[') && !sp->expect_key && __wcjs_is_key(sp)) {
+                        sp->in_array = true;
+                    }
+                    sink = sp->in_item ? WCJS_ITEM : WCJS_REST;
+                    sp->depth++;
+                    if (sp->depth == 1) sp->expect_key = true;
+                    break;
+                case '}':
+                case ']':
+                    if (at_items) {
+                        /* the end of the array */
+                        item_end = sp->in_item;
+                        sp->in_array = false;
+                        sink = WCJS_REST;
+                    } else
+                        sink = sp->in_item ? WCJS_ITEM : WCJS_REST;
+                    sp->depth--;
+                    break;
+                case ',':
+                    if (at_items) {
+                        item_end = sp->in_item;
+                        sink = WCJS_DROP;
+                    } else {
+                        if (sp->depth == 1) sp->expect_key = true;
+                        sink = sp->in_item ? WCJS_ITEM : WCJS_REST;
+                    }
+                    break;
+                case ':':
+                    if (sp->depth == 1) sp->expect_key = false;
+                    sink = sp->in_item ? WCJS_ITEM : WCJS_REST;
+                    break;
+                case ' ':
+                case '\t':
+                case '\r':
+                case '\n':
+                    sink = sp->in_item ? WCJS_ITEM : (at_items ? WCJS_DROP : WCJS_REST);
+                    break;
+                default:
+                    if (c == '\"') {
+                        sp->in_str = true;
+                        if ((sp->depth == 1) && sp->expect_key) {
+                            sp->in_key = true;
+                            sp->key_len = 0;
+                            sp->key_over = false;
+                        }
+                    }
+                    if (at_items) sp->in_item = true;
+                    sink = sp->in_item ? WCJS_ITEM : WCJS_REST;
+                    break;
+            }
+        }
+        if (item_end) {
+            if (!__wcjs_flush(sp, run_sink, &(data[run]), i - run)) return false;
+            run = i;
+            if (!__wcjs_item_end(sp)) return false;
+        }
+        if (sink != run_sink) {
+            if (!__wcjs_flush(sp, run_sink, &(data[run]), i - run)) return false;
+            run = i;
+            run_sink = sink;
+        }
+    }
+    return __wcjs_flush(sp, run_sink, &(data[run]), len - run);
+}
@@ -0,0 +1,96 @@
+// Copyright 2023 Medvedkov Ilya
+//
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef WC_JSON_H
+#define WC_JSON_H
+
+#include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <cJSON.h>
+
+// maximum nesting of the serialized tree
+#ifndef WC_JSON_MAX_DEPTH
+#define WC_JSON_MAX_DEPTH  16
+#endif
+
+#define WC_JSON_PEND_SIZE  32
+
+/* resumable serializer of the cJSON tree. writes the same text as
+ * cJSON_PrintUnformatted piece by piece without the whole string in memory.
+ * the tree must not be changed while it is written */
+typedef struct {
+    const cJSON * root;
+    const cJSON * cur;                          // item being written
+    const cJSON * stack[WC_JSON_MAX_DEPTH];     // containers of cur
+    int           depth;
+    uint8_t       phase;
+    bool          is_key;                       // str is the name of cur
+    bool          is_raw;                       // str is written as is
+    const char *  str;                          // string being escaped
+    size_t        str_pos;
+    char          pend[WC_JSON_PEND_SIZE];      // short pieces not written yet
+    uint8_t       pend_len;
+    uint8_t       pend_pos;
+} wc_json_writer;
+
+void wcJsonWriter_init(wc_json_writer * w, const cJSON * root);
+/* writes up to len bytes. returns the number of bytes written,
+ * 0 when the tree is over or -1 if the tree can not be serialized.
+ * buf may be NULL - the bytes are counted only */
+int  wcJsonWriter_write(wc_json_writer * w, char * buf, int len);
+bool wcJsonWriter_done(wc_json_writer * w);
+/* length of the unformatted text or -1 */
+int  wcJson_measure(const cJSON * root);
+
+#define WC_JSON_KEY_SIZE   16
+
+/* called for each complete item of the split array. item is zero terminated */
+typedef bool (* wc_json_on_item)(void * user_data, char * item, size_t len);
+/* called for the text around the items. the array is left empty there */
+typedef bool (* wc_json_on_rest)(void * user_data, const char * data, size_t len);
+
+/* incremental splitter of the json object. the items of the array under the
+ * top-level key are passed one by one as soon as they are received, so the
+ * size of the text is not bounded by the memory */
+typedef struct {
+    const char *  key;
+    char          key_buf[WC_JSON_KEY_SIZE];
+    uint8_t       key_len;
+    bool          key_over;
+    int           depth;
+    bool          in_str;
+    bool          in_esc;
+    bool          in_key;
+    bool          expect_key;
+    bool          in_array;                     // inside the array under key
+    bool          in_item;
+    bool          item_over;                    // item is longer than item_max
+    char *        item;
+    size_t        item_len;
+    size_t        item_size;
+    size_t        item_max;
+    uint32_t      items;                        // items passed
+    uint32_t      dropped;                      // items too long to be kept
+    wc_json_on_item on_item;
+    wc_json_on_rest on_rest;
+    void *        user_data;
+} wc_json_splitter;
+
+wc_json_splitter * wcJsonSplitter_init(const char * key, size_t item_max,
+                                       wc_json_on_item on_item, wc_json_on_rest on_rest,
+                                       void * user_data);
+/* false if the callback stopped the splitting */
+bool wcJsonSplitter_feed(wc_json_splitter * sp, const char * data, size_t len);
+void wcJsonSplitter_free(wc_json_splitter * sp);
+
+#endif
@@ -7,6 +7,7 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <string.h>
 #include "wcprotocol.h"
 
 const char * REST_RESPONSE_ERRORS[]  = {
@@ -22,4 +23,17 @@ const char * REST_RESPONSE_ERRORS[]  = {
                               "NO_SUCH_RECORD",
                               "NO_DATA_RETURNED",
                               "EMPTY_REQUEST",
-                              "MALFORMED_REQUEST"};
\ No newline at end of file
+                              "MALFORMED_REQUEST"};
+
+uint8_t wcProtocol_frame_header_version(const char * subproto) {
+    if (subproto == NULL) return 1;
+    size_t len = strlen(subproto);
+    size_t slen = strlen(WEBCAM_SUBPROTO_V2_SUFFIX);
+    if ((len >= slen) && (strcmp(&(subproto[len - slen]), WEBCAM_SUBPROTO_V2_SUFFIX) == 0))
+        return 2;
+    return 1;
+}
+
+int32_t wcProtocol_frame_header_size(uint8_t version) {
+    return (version >= 2) ? WEBCAM_FRAME_HEADER_V2_SIZE : WEBCAM_FRAME_HEADER_SIZE;
+}
@@ -10,11 +10,18 @@
 #ifndef WC_PROTOCOL_
 #define WC_PROTOCOL_
 
+#include <stdint.h>
 #include <cJSON.h>
 
 /* Dataframes defines */
 #define WEBCAM_FRAME_HEADER_SIZE (sizeof(uint16_t) + sizeof(uint32_t))
 #define WEBCAM_FRAME_START_SEQ   0xaaaa
+/* v2 header: start seq, body size, sequence number, capture time in ms, flags */
+#define WEBCAM_FRAME_HEADER_V2_SIZE (WEBCAM_FRAME_HEADER_SIZE + 2 * sizeof(uint32_t) + sizeof(uint16_t))
+#define WEBCAM_FRAME_HEADER_MAX_SIZE WEBCAM_FRAME_HEADER_V2_SIZE
+#define WEBCAM_FRAME_FLAG_KEYFRAME 0x0001
+/* the stream with the subproto ending with the suffix uses the v2 header */
+#define WEBCAM_SUBPROTO_V2_SUFFIX  "_FH2"
 
 /* Commands */
 #define HTTP2_STREAMING_AUTH_PATH        "/authorize.json"
@@ -67,4 +74,8 @@
 
 extern const char * REST_RESPONSE_ERRORS[];
 
+/* version of the frame header for the stream subproto. 1 or 2 */
+uint8_t wcProtocol_frame_header_version(const char * subproto);
+int32_t wcProtocol_frame_header_size(uint8_t version);
+
 #endif